@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Sequential throughput of sbull against bio size.
+#
+# Loads the given sbull module, populates the first SIZE_MB of the device
+# once, then for each block size from 4 KiB to 4 MiB measures steady-state
+# sequential read and overwrite bandwidth over that region.  Run it once
+# against the old module and once against the new one to compare:
+#
+#   ./sbull_biosize.sh ../sbull2.ko > after.txt
+#
+# Extra module parameters (e.g. queue_mode=1) go after the size and runtime.
+# Needs root and fio.
+
+KO=${1:?usage: $0 <sbull module.ko> [size_mb] [runtime_s] [module params...]}
+SIZE_MB=${2:-256}
+RUNTIME=${3:-10}
+shift 3 2>/dev/null || shift $#
+DEV=/dev/sbull0
+
+insmod "$KO" "$@" || exit 1
+trap 'rmmod "$(basename "$KO" .ko)"' EXIT
+
+fio --name=fill --filename=$DEV --rw=write --bs=1M --direct=1 \
+    --size=${SIZE_MB}M --minimal > /dev/null
+
+echo "# bs read_kib_s write_kib_s"
+for bs in 4k 16k 64k 256k 1m 4m; do
+        # Fields 7 and 48 of fio's terse output are read and write bandwidth.
+        rd=$(fio --name=read --filename=$DEV --rw=read --bs=$bs --direct=1 \
+                 --ioengine=libaio --iodepth=4 --size=${SIZE_MB}M \
+                 --time_based --runtime=$RUNTIME --minimal | cut -d';' -f7)
+        wr=$(fio --name=write --filename=$DEV --rw=write --bs=$bs --direct=1 \
+                 --ioengine=libaio --iodepth=4 --size=${SIZE_MB}M \
+                 --time_based --runtime=$RUNTIME --minimal | cut -d';' -f48)
+        echo "$bs $rd $wr"
+done
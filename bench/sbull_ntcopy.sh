@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Cached against non-temporal copies for big sbull transfers: bandwidth
+# of 1 MiB sequential reads and writes, and how many LLC misses they
+# cause system-wide, with nt_copy_kb off and on.
+#
+# Loads the given sbull module, populates the first SIZE_MB of the
+# device, then runs each direction twice, flipping nt_copy_kb through
+# sysfs in between.  The LLC-miss columns are what a co-located service
+# would feel; the debugfs counters confirm which path the bios took:
+#
+#   ./sbull_ntcopy.sh ../sbull2.ko 1024 > ntcopy.txt
+#
+# Extra module parameters (e.g. queue_mode=1) go after the size and runtime.
+# Needs root, fio and perf.
+
+KO=${1:?usage: $0 <sbull module.ko> [size_mb] [runtime_s] [module params...]}
+SIZE_MB=${2:-1024}
+RUNTIME=${3:-10}
+shift 3 2>/dev/null || shift $#
+MOD=$(basename "$KO" .ko)
+DEV=/dev/sbull0
+PARAM=/sys/module/$MOD/parameters/nt_copy_kb
+STATS=/sys/kernel/debug/sbull0/stats
+
+insmod "$KO" "$@" || exit 1
+trap 'rmmod "$MOD"' EXIT
+
+fio --name=fill --filename=$DEV --rw=write --bs=1M --direct=1 \
+    --size=${SIZE_MB}M --minimal > /dev/null
+
+counter() {
+        awk -v k="$1" '$1 == k { print $2 }' $STATS
+}
+
+echo "# rw nt_copy_kb kib_s llc_load_misses llc_store_misses copy_bytes nt_bytes"
+for rw in read write; do
+        for kb in 0 256; do
+                echo $kb > $PARAM
+                cb=$(counter copy_bytes)
+                nb=$(counter nt_bytes)
+                # Fields 7 and 48 of fio's terse output are read and write bandwidth.
+                [ $rw = read ] && f=7 || f=48
+                out=$(perf stat -a -x, -e LLC-load-misses,LLC-store-misses -o /dev/stdout \
+                        fio --name=$rw --filename=$DEV --rw=$rw --bs=1M --direct=1 \
+                            --ioengine=libaio --iodepth=4 --size=${SIZE_MB}M \
+                            --time_based --runtime=$RUNTIME --minimal)
+                bw=$(echo "$out" | grep ';' | cut -d';' -f$f)
+                lm=$(echo "$out" | awk -F, '$3 == "LLC-load-misses" { print $1 }')
+                sm=$(echo "$out" | awk -F, '$3 == "LLC-store-misses" { print $1 }')
+                echo "$rw $kb $bw $lm $sm $(($(counter copy_bytes) - cb)) $(($(counter nt_bytes) - nb))"
+        done
+done
@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Random-read IOPS of sbull as the device fills up.
+#
+# Loads the given sbull module, then repeatedly populates another STEP_MB
+# of the device with sequential writes and measures 4 KiB random-read
+# IOPS over the populated part.  Run it once against the old module and
+# once against the new one to compare:
+#
+#   ./sbull_occupancy.sh ../sbull2.ko > after.txt
+#
+# Needs root and fio.
+
+KO=${1:?usage: $0 <sbull module.ko> [step_mb] [max_mb] [runtime_s]}
+STEP_MB=${2:-64}
+MAX_MB=${3:-448}
+RUNTIME=${4:-10}
+DEV=/dev/sbull0
+
+insmod "$KO" || exit 1
+trap 'rmmod "$(basename "$KO" .ko)"' EXIT
+
+echo "# occupancy_mb randread_iops"
+filled=0
+while [ $filled -lt $MAX_MB ]; do
+        fio --name=fill --filename=$DEV --rw=write --bs=1M --direct=1 \
+            --offset=${filled}M --size=${STEP_MB}M --minimal > /dev/null
+        filled=$((filled + STEP_MB))
+
+        # Field 8 of fio's terse output is read IOPS.
+        iops=$(fio --name=randread --filename=$DEV --rw=randread --bs=4k \
+                   --direct=1 --ioengine=libaio --iodepth=32 --numjobs=1 \
+                   --size=${filled}M --time_based --runtime=$RUNTIME \
+                   --minimal | cut -d';' -f8)
+        echo "$filled $iops"
+done
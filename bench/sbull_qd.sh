@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# 4 KiB random-read IOPS of sbull against queue depth, through io_uring,
+# both interrupt-driven and polled.
+#
+# Loads the given sbull module with blk-mq and one poll queue (plus any
+# extra module parameters, e.g. async_io=1 or completion_nsec=20000),
+# populates the first SIZE_MB of the device, then sweeps iodepth:
+#
+#   ./sbull_qd.sh ../sbull2.ko 256 10 async_io=1 > async.txt
+#
+# Needs root and fio built with io_uring support.
+
+KO=${1:?usage: $0 <sbull module.ko> [size_mb] [runtime_s] [module params...]}
+SIZE_MB=${2:-256}
+RUNTIME=${3:-10}
+shift 3 2>/dev/null || shift $#
+DEV=/dev/sbull0
+
+insmod "$KO" queue_mode=1 poll_queues=1 "$@" || exit 1
+trap 'rmmod "$(basename "$KO" .ko)"' EXIT
+
+fio --name=fill --filename=$DEV --rw=write --bs=1M --direct=1 \
+    --size=${SIZE_MB}M --minimal > /dev/null
+
+echo "# iodepth irq_iops polled_iops"
+for qd in 1 2 4 8 16 32 64 128; do
+        # Field 8 of fio's terse output is read IOPS.
+        irq=$(fio --name=qd --filename=$DEV --rw=randread --bs=4k --direct=1 \
+                  --ioengine=io_uring --iodepth=$qd --size=${SIZE_MB}M \
+                  --time_based --runtime=$RUNTIME --minimal | cut -d';' -f8)
+        pol=$(fio --name=qd --filename=$DEV --rw=randread --bs=4k --direct=1 \
+                  --ioengine=io_uring --hipri --iodepth=$qd --size=${SIZE_MB}M \
+                  --time_based --runtime=$RUNTIME --minimal | cut -d';' -f8)
+        echo "$qd $irq $pol"
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Tail latency of first-touch 4 KiB random writes to sbull, where every
+# write has to find a new page, with and without memory pressure.
+#
+# Loads the given sbull module (plus any extra module parameters, e.g.
+# pcp_pages=0 page_reserve=0 for the old behaviour) and writes SIZE_MB of
+# fresh pages twice: once on an idle host, once with stress-ng keeping
+# the page allocator busy reclaiming:
+#
+#   ./sbull_wlat.sh ../sbull2.ko 1024 > cached.txt
+#   ./sbull_wlat.sh ../sbull2.ko 1024 pcp_pages=0 page_reserve=0 > direct.txt
+#
+# Needs root, fio, jq and stress-ng.
+
+KO=${1:?usage: $0 <sbull module.ko> [size_mb] [module params...]}
+SIZE_MB=${2:-1024}
+shift 2 2>/dev/null || shift $#
+MOD=$(basename "$KO" .ko)
+DEV=/dev/sbull0
+
+run() {
+        insmod "$KO" capacity_mb=$SIZE_MB "$@" || exit 1
+        fio --name=wlat --filename=$DEV --rw=randwrite --bs=4k --direct=1 \
+            --ioengine=io_uring --iodepth=16 --size=${SIZE_MB}M \
+            --percentile_list=50:99:99.9:99.99 --output-format=json |
+                jq -r '.jobs[0].write | [.iops,
+                        .clat_ns.percentile["50.000000"],
+                        .clat_ns.percentile["99.000000"],
+                        .clat_ns.percentile["99.900000"],
+                        .clat_ns.percentile["99.990000"]] | @tsv'
+        rmmod "$MOD"
+}
+
+echo "# pressure iops p50_ns p99_ns p99.9_ns p99.99_ns"
+printf "none\t"
+run "$@"
+
+stress-ng --vm "$(nproc)" --vm-bytes 90% --vm-keep --timeout 0 > /dev/null 2>&1 &
+STRESS=$!
+trap 'kill $STRESS 2>/dev/null' EXIT
+sleep 5
+printf "vm\t"
+run "$@"
@@ -2,6 +2,7 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/log2.h>
 
 #include "sbuf.h"
 
@@ -44,6 +45,81 @@ int sbuf_remove(sbuf_t * sp)
         return item;
 }
 
+/*
+ * create an empty single-producer/single-consumer buffer with n slots;
+ * returns 0, or -EINVAL if n < 1 or -ENOMEM if the ring can't be allocated
+ */
+int sbuf_spsc_init(sbuf_spsc_t * sp, int n)
+{
+        unsigned int size;
+
+        if (n < 1)
+                return -EINVAL;         /* roundup_pow_of_two(0) is undefined */
+        size = roundup_pow_of_two(n);
+
+        sp->buf = kmalloc_array(size, sizeof(int), GFP_KERNEL);
+        if (!sp->buf)
+                return -ENOMEM;
+        sp->mask = size - 1;
+        sp->n = n;              /* Ring may be bigger, but holds max of n items */
+        sp->head = sp->tail = 0;        /* Empty buffer iff head == tail */
+        sp->head_seen = sp->tail_seen = 0;
+        init_waitqueue_head(&sp->not_full);
+        init_waitqueue_head(&sp->not_empty);
+        return 0;
+}
+
+/* clean up buffer sp */
+void sbuf_spsc_deinit(sbuf_spsc_t * sp)
+{
+        kfree(sp->buf);
+}
+
+/*
+ * Wake the other side if it is asleep.  The barrier orders our index
+ * store before the waitqueue check, and pairs with the one in
+ * prepare_to_wait() between the sleeper queueing itself and rechecking
+ * our index, so that one of us always sees the other.
+ */
+static inline void sbuf_spsc_wake(wait_queue_head_t *wq)
+{
+        smp_mb();
+        if (waitqueue_active(wq))
+                wake_up(wq);
+}
+
+/* insert item onto the rear of buffer sp; only ever from one thread */
+void sbuf_spsc_insert(sbuf_spsc_t * sp, int item)
+{
+        unsigned int tail = sp->tail;
+
+        if (tail - sp->head_seen == sp->n) {
+                /* Looks full: look again, and wait for a slot if it is */
+                wait_event(sp->not_full,
+                           tail - (sp->head_seen = smp_load_acquire(&sp->head)) != sp->n);
+        }
+        sp->buf[tail & sp->mask] = item;        /* Insert the item */
+        smp_store_release(&sp->tail, tail + 1); /* Announce it */
+        sbuf_spsc_wake(&sp->not_empty);
+}
+
+/* remove and return the first item from buffer sp; only ever from one thread */
+int sbuf_spsc_remove(sbuf_spsc_t * sp)
+{
+        unsigned int head = sp->head;
+        int item;
+
+        if (sp->tail_seen == head) {
+                /* Looks empty: look again, and wait for an item if it is */
+                wait_event(sp->not_empty,
+                           (sp->tail_seen = smp_load_acquire(&sp->tail)) != head);
+        }
+        item = sp->buf[head & sp->mask];        /* Remove the item */
+        smp_store_release(&sp->head, head + 1); /* Announce the free slot */
+        sbuf_spsc_wake(&sp->not_full);
+        return item;
+}
+
 static int simple_init(void)
 {
         pr_info("Loading sbuf\n");
@@ -62,6 +138,10 @@ EXPORT_SYMBOL(sbuf_init);
 EXPORT_SYMBOL(sbuf_deinit);
 EXPORT_SYMBOL(sbuf_insert);
 EXPORT_SYMBOL(sbuf_remove);
+EXPORT_SYMBOL(sbuf_spsc_init);
+EXPORT_SYMBOL(sbuf_spsc_deinit);
+EXPORT_SYMBOL(sbuf_spsc_insert);
+EXPORT_SYMBOL(sbuf_spsc_remove);
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Simple Module");
 MODULE_AUTHOR("KOO");
@@ -12,17 +12,22 @@
 
 #include "sbuf.h"
 
-/* create an empty, bounded, shared FIFO buffer with n slots */
-extern void sbuf_init(sbuf_t * sp, int n);
+/*
+ * One producer and one consumer, so the lock-free single-producer/
+ * single-consumer buffer will do.
+ */
+
+/* create an empty single-producer/single-consumer buffer with n slots */
+extern int sbuf_spsc_init(sbuf_spsc_t * sp, int n);
 
 /* clean up buffer sp */
-extern void sbuf_deinit(sbuf_t * sp);
+extern void sbuf_spsc_deinit(sbuf_spsc_t * sp);
 
-/* insert item onto the rear of shared buffer sp */
-extern void sbuf_insert(sbuf_t * sp, int item);
+/* insert item onto the rear of buffer sp; only ever from one thread */
+extern void sbuf_spsc_insert(sbuf_spsc_t * sp, int item);
 
-/* remove and return the first item from buffer sp */
-extern int sbuf_remove(sbuf_t * sp);
+/* remove and return the first item from buffer sp; only ever from one thread */
+extern int sbuf_spsc_remove(sbuf_spsc_t * sp);
 
 #define SBUFSIZE 3
 #define NUM_SBUF 1
@@ -32,7 +37,7 @@ extern int sbuf_remove(sbuf_t * sp);
 static struct task_struct *pthreads = NULL;
 static struct task_struct *cthreads = NULL;
 static volatile int exit_flag = 0, enqueue_flag = 0, dequeue_flag = 0;
-sbuf_t *sbufs = NULL;
+sbuf_spsc_t *sbufs = NULL;
 
 static struct workqueue_struct *my_workqueue;
 static struct work_struct my_enqueue_work;
@@ -104,7 +109,7 @@ static int producer(void *arg)
 	__set_current_state(TASK_RUNNING);
 
         if (enqueue_flag) {
-            sbuf_insert(sbufs, val);
+            sbuf_spsc_insert(sbufs, val);
             
             pr_info("Producer enqueued item: %d\n",val);
             
@@ -137,7 +142,7 @@ static int consumer(void *arg)
 	__set_current_state(TASK_RUNNING);
 	    
         if (dequeue_flag) {
-            item = sbuf_remove(sbufs);
+            item = sbuf_spsc_remove(sbufs);
             pr_info("Consumer dequeued item: %d\n",item);
             dequeue_flag = 0;
         }
@@ -157,8 +162,16 @@ static int simple_init(void)
 {
     int ret;
 
-    sbufs = (sbuf_t *) kmalloc(sizeof(sbuf_t) * NUM_SBUF, GFP_KERNEL);
-    sbuf_init(&sbufs[0], SBUFSIZE);
+    sbufs = (sbuf_spsc_t *) kmalloc(sizeof(sbuf_spsc_t) * NUM_SBUF, GFP_KERNEL);
+    if (!sbufs)
+        return -ENOMEM;
+    ret = sbuf_spsc_init(&sbufs[0], SBUFSIZE);
+    if (ret) {
+        pr_err("Failed to init sbuf: %d\n", ret);
+        kfree(sbufs);
+        sbufs = NULL;
+        return ret;
+    }
     
     my_workqueue = create_workqueue("my_workqueue");
     INIT_WORK(&my_enqueue_work, do_enqueue_work);
@@ -219,6 +232,7 @@ static void simple_exit(void)
     pr_info("my workqueue destroyed\n");
         
     if(sbufs){
+        sbuf_spsc_deinit(&sbufs[0]);
         kfree(sbufs);
         pr_info("sbuf freed\n");
           sbufs = NULL;
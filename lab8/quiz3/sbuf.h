@@ -1,4 +1,6 @@
 #include <linux/semaphore.h>
+#include <linux/wait.h>
+#include <linux/cache.h>
 
 typedef struct {
         int *buf;               /* buffer array */
@@ -9,3 +11,27 @@ typedef struct {
         struct semaphore slots; /* counts available slots */
         struct semaphore items; /* counts available items */
 } sbuf_t;
+
+/*
+ * Single-producer/single-consumer variant: the same bounded FIFO for
+ * exactly one inserting and one removing thread, with no locks.  The
+ * ring is a power of two in size and the indices run free, so the
+ * slot is index & mask and the ring holds tail - head items.  Each side
+ * owns one index, on its own cache line with its last look at the other,
+ * and publishes it with a release store that the other side pairs with
+ * an acquire load.  A side only sleeps when the ring is empty (remove)
+ * or holds n items (insert).
+ */
+typedef struct {
+        unsigned int tail ____cacheline_aligned_in_smp; /* buf[tail & mask] is the next free slot */
+        unsigned int head_seen;         /* producer's last look at head */
+
+        unsigned int head ____cacheline_aligned_in_smp; /* buf[head & mask] is the first item */
+        unsigned int tail_seen;         /* consumer's last look at tail */
+
+        int *buf ____cacheline_aligned_in_smp; /* ring array */
+        unsigned int mask;              /* ring size - 1 */
+        unsigned int n;                 /* maximum number of items */
+        wait_queue_head_t not_full;     /* producer waits for a slot */
+        wait_queue_head_t not_empty;    /* consumer waits for an item */
+} sbuf_spsc_t;
@@ -0,0 +1,4062 @@
+/*
+ * Sample disk driver, from the beginning.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/init.h>
+
+#include <linux/sched.h>
+#include <linux/kernel.h>       /* printk() */
+#include <linux/slab.h>         /* kmalloc() */
+#include <linux/fs.h>           /* everything... */
+#include <linux/errno.h>        /* error codes */
+#include <linux/timer.h>
+#include <linux/types.h>        /* size_t */
+#include <linux/fcntl.h>        /* O_ACCMODE */
+#include <linux/hdreg.h>        /* HDIO_GETGEO */
+#include <linux/kdev_t.h>
+#include <linux/vmalloc.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>  /* invalidate_bdev */
+#include <linux/bio.h>
+#include <linux/blk-mq.h>
+#include <linux/xarray.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu_counter.h>
+#include <linux/crypto.h>
+#include <linux/zsmalloc.h>
+#include <linux/local_lock.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/xxhash.h>
+#include <linux/refcount.h>
+#include <linux/log2.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/hrtimer.h>
+#include <linux/random.h>
+#include <linux/rwsem.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/mutex.h>
+#include <linux/mempool.h>
+#include <linux/sched/mm.h>
+#include <linux/uio.h>
+
+#include "sbull_store.h"
+
+#define CREATE_TRACE_POINTS
+#include "sbull_trace.h"
+
+MODULE_LICENSE("Dual BSD/GPL");
+
+static int sbull_major = 0;
+static int hardsect_size = 512;
+static int nsectors = 1024 * 1024;      /* How big the drive is */
+
+/*
+ * sbull0 .. sbull<nr_devices - 1>, each with its own size and home NUMA
+ * node: its pages, metadata and workers are allocated on that node.
+ */
+#define SBULL_MAX_DEVICES       32
+
+static int nr_devices = 1;
+module_param(nr_devices, int, 0444);
+MODULE_PARM_DESC(nr_devices, "Number of sbull devices (default: 1)");
+
+static ulong capacity_mb[SBULL_MAX_DEVICES];
+static int nr_capacity;
+module_param_array(capacity_mb, ulong, &nr_capacity, 0444);
+MODULE_PARM_DESC(capacity_mb, "Size of each device in MiB, comma separated (default: 512)");
+
+static int home_node[SBULL_MAX_DEVICES];
+static int nr_home_node;
+module_param_array(home_node, int, &nr_home_node, 0444);
+MODULE_PARM_DESC(home_node, "NUMA node of each device, comma separated, -1 for any (default: spread over nodes)");
+
+/*
+ * sbull can take I/O either as bare bios through ->submit_bio, or as
+ * requests through blk-mq with per-CPU hardware queues.
+ */
+enum {
+        SBULL_Q_BIO = 0,
+        SBULL_Q_MQ = 1,
+};
+
+static int queue_mode = SBULL_Q_BIO;
+module_param(queue_mode, int, 0444);
+MODULE_PARM_DESC(queue_mode, "I/O front end: 0=bio, 1=blk-mq");
+
+static int submit_queues;
+module_param(submit_queues, int, 0444);
+MODULE_PARM_DESC(submit_queues, "Number of blk-mq hardware queues (default: one per CPU)");
+
+static int hw_queue_depth = 128;
+module_param(hw_queue_depth, int, 0444);
+MODULE_PARM_DESC(hw_queue_depth, "Queue depth of each blk-mq hardware queue");
+
+static int poll_queues;
+module_param(poll_queues, int, 0444);
+MODULE_PARM_DESC(poll_queues, "Number of extra blk-mq hardware queues for polled I/O (default: 0)");
+
+static bool async_io;
+module_param(async_io, bool, 0444);
+MODULE_PARM_DESC(async_io, "Transfer and complete I/O from per-CPU workers instead of the submitter");
+
+static char *comp_algorithm;
+module_param(comp_algorithm, charp, 0444);
+MODULE_PARM_DESC(comp_algorithm, "Compress pages with this crypto algorithm, e.g. lz4 (default: off)");
+
+static bool dedup;
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "Share one page between blocks with identical contents");
+
+static int chunk_order;
+module_param(chunk_order, int, 0444);
+MODULE_PARM_DESC(chunk_order, "Back the device with 2^order-page chunks, e.g. 9 for 2 MiB (default: 0)");
+
+static int pcp_pages = 32;
+module_param(pcp_pages, int, 0444);
+MODULE_PARM_DESC(pcp_pages, "Zeroed pages each CPU keeps ready per device for new writes, 0..64 (default: 32)");
+
+static int page_reserve = 256;
+module_param(page_reserve, int, 0444);
+MODULE_PARM_DESC(page_reserve, "Pages per device held in reserve for new writes under memory pressure (default: 256)");
+
+static ulong populate_mb[SBULL_MAX_DEVICES];
+static int nr_populate_mb;
+module_param_array(populate_mb, ulong, &nr_populate_mb, 0444);
+MODULE_PARM_DESC(populate_mb, "Per device, allocate this many MiB from the start of the device at load time (default: 0)");
+
+static int populate_threads;
+module_param(populate_threads, int, 0444);
+MODULE_PARM_DESC(populate_threads, "Workers per device for populate_mb (default: one per online CPU)");
+
+static bool populate_pin;
+module_param(populate_pin, bool, 0444);
+MODULE_PARM_DESC(populate_pin, "Never give device memory back: discard zeroes pages in place, and same-filled pages keep theirs");
+
+
+static bool zoned;
+module_param(zoned, bool, 0444);
+MODULE_PARM_DESC(zoned, "Emulate a host-managed zoned device");
+
+static ulong zone_size_mb = 256;
+module_param(zone_size_mb, ulong, 0444);
+MODULE_PARM_DESC(zone_size_mb, "Zone size in MiB, a power of two (default: 256)");
+
+static ulong zone_capacity_mb;
+module_param(zone_capacity_mb, ulong, 0444);
+MODULE_PARM_DESC(zone_capacity_mb, "Writable MiB of each sequential zone (default: 0, the whole zone)");
+
+static uint zone_nr_conv;
+module_param(zone_nr_conv, uint, 0444);
+MODULE_PARM_DESC(zone_nr_conv, "Conventional zones at the start of the device (default: 0)");
+
+static uint zone_max_open;
+module_param(zone_max_open, uint, 0444);
+MODULE_PARM_DESC(zone_max_open, "Most zones open at once (default: 0, no limit)");
+
+static uint zone_max_active;
+module_param(zone_max_active, uint, 0444);
+MODULE_PARM_DESC(zone_max_active, "Most zones open or closed at once (default: 0, no limit)");
+
+static char *image[SBULL_MAX_DEVICES];
+static int nr_image;
+module_param_array(image, charp, &nr_image, 0444);
+MODULE_PARM_DESC(image, "Per device, load the contents from this file at load time and save them back at unload (default: none)");
+
+static char *backing_file[SBULL_MAX_DEVICES];
+static int nr_backing_file;
+module_param_array(backing_file, charp, &nr_backing_file, 0444);
+MODULE_PARM_DESC(backing_file, "Per device, evict cold pages to this file once over mem_limit_mb (default: none)");
+
+static ulong mem_limit_mb;
+module_param(mem_limit_mb, ulong, 0444);
+MODULE_PARM_DESC(mem_limit_mb, "Memory for the pages of each device with a backing_file, in MiB");
+
+/* Can be changed at any time. */
+static uint nt_copy_kb = 1024;
+module_param(nt_copy_kb, uint, 0644);
+MODULE_PARM_DESC(nt_copy_kb, "Copy bios of at least this many KiB with non-temporal stores, bypassing the CPU caches (default: 1024, 0: never)");
+
+/* Emulating a slower device; these can be changed at any time. */
+static ulong completion_nsec;
+module_param(completion_nsec, ulong, 0644);
+MODULE_PARM_DESC(completion_nsec, "Fixed latency added to every I/O, in ns (default: 0)");
+
+static uint completion_jitter_nsec;
+module_param(completion_jitter_nsec, uint, 0644);
+MODULE_PARM_DESC(completion_jitter_nsec, "Random extra latency per I/O, uniform in [0, this) ns (default: 0)");
+
+static uint bandwidth_mbs;
+module_param(bandwidth_mbs, uint, 0644);
+MODULE_PARM_DESC(bandwidth_mbs, "Cap data throughput at this many MB/s (default: 0, no cap)");
+
+/*
+ * We can tweak our hardware sector size, but the kernel talks to us
+ * in terms of small sectors, always.
+ */
+#define KERNEL_SECTOR_SIZE      512
+
+/* Largest request we ask the block layer to build for us. */
+#define SBULL_MAX_IO_BYTES      (4UL << 20)
+
+/*
+ * A whole index.  A device reads and writes its own top layer; taking a
+ * snapshot freezes that layer and stacks an empty one on it, so frozen
+ * layers are shared, read-only, by a device and its snapshots (see
+ * "Snapshots" below).
+ */
+struct sbull_layer {
+        struct sbull_store_shard shards[SBULL_SHARDS]; /* layout in sbull_store.h */
+        struct sbull_layer *parent;     /* frozen layer below, or NULL */
+        refcount_t ref;                 /* the device or layers on top of it */
+        s64 nr_pages;                   /* frozen: pages it holds */
+        struct llist_node reap;         /* on dev->reap once reset away */
+};
+
+/*
+ * Per-CPU compression context for comp_algorithm, and the cost counters
+ * it keeps (updated under @lock, so plain u64s are enough).
+ */
+struct sbull_zstrm {
+        local_lock_t lock;
+        struct crypto_comp *tfm;
+        u8 *buffer;                     /* 2 pages: output may exceed input */
+        u64 comp_ops, comp_ns;
+        u64 decomp_ops, decomp_ns;
+};
+
+/*
+ * Per-CPU I/O statistics, summed over all CPUs only when read through
+ * debugfs.  Each CPU touches nothing but its own copy, so collecting
+ * them costs the hot path a few this_cpu adds and no shared cache lines.
+ */
+enum {
+        SBULL_STAT_READ,
+        SBULL_STAT_WRITE,
+        SBULL_STAT_DISCARD,             /* and write zeroes, zone management */
+        SBULL_NR_STATS,
+};
+
+#define SBULL_LAT_BUCKETS       32      /* bucket b: [2^b, 2^(b+1)) ns; the last takes the rest */
+
+struct sbull_stats {
+        u64 ops[SBULL_NR_STATS];
+        u64 bytes[SBULL_NR_STATS];
+        u64 lat[SBULL_NR_STATS][SBULL_LAT_BUCKETS];
+        u64 allocs;                     /* backing pages, chunks or objects allocated */
+        u64 cache_allocs;               /* of which came from a per-CPU page cache */
+        u64 lookups;                    /* index walks, one per entry or window */
+        u64 lookup_levels;              /* xarray levels those walks descended */
+        u64 evictions;                  /* pages moved out to backing_file */
+        u64 writebacks;                 /* of which had to be written */
+        u64 faults;                     /* pages read back in */
+        u64 copyups;                    /* pages copied out of a snapshot to be written */
+        u64 copy_ios;                   /* fast-path bios copied through the caches */
+        u64 copy_bytes;
+        u64 nt_ios;                     /* and around them, nt_copy_kb */
+        u64 nt_bytes;
+};
+
+/*
+ * The internal representation of our device.
+ */
+struct sbull_dev {
+        unsigned long size;
+        int users;
+        spinlock_t lock;
+        int index;                      /* sbull<index> */
+        int node;                       /* home NUMA node */
+        const char *image;              /* image=, or NULL */
+
+        struct gendisk *gendisk;
+        struct blk_mq_tag_set tag_set;  /* queue_mode=1 only */
+        struct sbull_layer *top;        /* the index; replaced under snap_sem */
+        struct sbull_store store;       /* over top, with the ops below */
+        struct percpu_rw_semaphore snap_sem; /* transfers shared, snapshot/reset exclusive */
+        struct llist_head reap;         /* layers dropped by reset, to free */
+        struct work_struct reap_work;
+        struct sbull_stats __percpu *stats;
+        atomic64_t bw_clock;            /* emulated link busy until, in ns */
+        atomic_t emul_pending;          /* bios held back by emulation */
+        struct sbull_async __percpu *async; /* async_io only */
+        struct sbull_pcp __percpu *pcp; /* pcp_pages only */
+        mempool_t *page_pool;           /* page_reserve only */
+        struct work_struct pool_work;
+        struct dentry *debugfs;         /* /sys/kernel/debug/sbullN */
+
+        /* zoned only */
+        struct sbull_zone *zones;
+        unsigned int nr_zones;
+        unsigned int zone_nr_conv;
+        unsigned int zone_shift;        /* zone size, in sectors */
+        sector_t zone_cap;              /* writable sectors per sequential zone */
+        spinlock_t zone_res_lock;
+        unsigned int nr_open;           /* zones implicitly or explicitly open */
+        unsigned int nr_active;         /* open or closed */
+
+        /* comp_algorithm only */
+        struct zs_pool *zpool;
+        struct sbull_zstrm __percpu *zstrm;
+        struct percpu_counter compr_bytes;
+        struct llist_head zfree;        /* replaced objects awaiting a grace period */
+        struct work_struct zfree_work;
+
+        /* backing_file only */
+        struct file *backing;
+        unsigned long mem_limit;        /* in pages */
+        struct percpu_counter nr_evicted;
+        struct work_struct evict_work;
+        unsigned int hand_shard;        /* the clock hand */
+        unsigned long hand_key;
+
+        /* dedup only */
+        struct sbull_dbucket *dhash;
+        unsigned long dhash_mask;
+        struct percpu_counter nr_unique; /* distinct pages behind the index */
+        struct percpu_counter dedup_hits;
+};
+
+static struct sbull_dev **sbull_devices;
+
+// TODO: You can declare global variables too
+
+/*
+ * Device data is kept in bare pages from the page allocator, indexed by
+ * page number (byte offset >> PAGE_SHIFT).  The xarray is the only
+ * per-page metadata, so a populated page costs PAGE_SIZE plus a slot in
+ * an xarray node.  With comp_algorithm set, the index holds a
+ * struct sbull_zobj per page instead (see below).  Either way, a page
+ * that is one 32-bit word repeated is held as an xarray value entry
+ * carrying that word, with no memory behind it.
+ *
+ * With chunk_order set, each entry is instead a compound page covering
+ * 2^chunk_order pages and the index is by chunk number (byte offset >>
+ * chunk_shift), so a large transfer is one lookup and one contiguous
+ * copy, and the index is 2^chunk_order times smaller.  Chunks are only
+ * ever plain memory: no fill entries, compression or dedup.
+ *
+ * Lookups are lock-free under rcu_read_lock(); the caller must stay in
+ * the RCU read-side section for as long as it touches the entry.
+ * Inserts take only the owning shard's xa_lock.  Entries dropped while
+ * the device is live (discard, overwrite of a compressed page) are freed
+ * only after an RCU grace period.
+ */
+static struct xarray *sbull_layer_shard(struct sbull_layer *l, unsigned long idx,
+                                        unsigned long *key)
+{
+        return &l->shards[sbull_index_key(idx, key)].pages;
+}
+
+static inline struct xarray *sbull_shard(struct sbull_dev *dev, unsigned long idx,
+                                         unsigned long *key)
+{
+        return sbull_layer_shard(dev->top, idx, key);
+}
+
+/*
+ * Count an index walk of @xa and how many levels deep it has to go.
+ */
+static inline void sbull_account_lookup(struct sbull_dev *dev, struct xarray *xa)
+{
+        void *head = xa_head(xa);
+
+        this_cpu_inc(dev->stats->lookups);
+        if (xa_is_node(head))
+                this_cpu_add(dev->stats->lookup_levels,
+                             xa_to_node(head)->shift / XA_CHUNK_SHIFT + 1);
+}
+
+/*
+ * Look up the entry backing page @idx, or NULL if it was never written.
+ * Must be called under rcu_read_lock().
+ */
+static void *sbull_lookup_entry(struct sbull_dev *dev, unsigned long idx)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_shard(dev, idx, &key);
+
+        void *entry;
+
+        sbull_account_lookup(dev, xa);
+        entry = xa_load(xa, key);
+        if (entry)
+                trace_sbull_lookup_hit(idx);
+        else
+                trace_sbull_lookup_miss(idx);
+        return entry;
+}
+
+/*
+ * Look up page @idx in the frozen layers under the device's own, where
+ * pages not written since the last snapshot are.  Frozen layers never
+ * change, so the entry is good for as long as snap_sem is held.
+ */
+static void *sbull_lookup_below(struct sbull_dev *dev, unsigned long idx)
+{
+        struct sbull_layer *l;
+        unsigned long key;
+        void *entry;
+
+        for (l = dev->top->parent; l; l = l->parent) {
+                struct xarray *xa = sbull_layer_shard(l, idx, &key);
+
+                sbull_account_lookup(dev, xa);
+                entry = xa_load(xa, key);
+                if (entry)
+                        return entry;
+        }
+        return NULL;
+}
+
+static void sbull_retire_entry(struct sbull_dev *dev, void *entry);
+
+static inline u32 sbull_entry_fill(void *entry)
+{
+        return entry ? xa_to_value(entry) : 0;
+}
+
+/*
+ * With a backing_file, a page that was moved out to it is held as
+ * SBULL_EVICTED, its data at the page's own offset in the file.  Does
+ * @entry hold data (maybe compressed or evicted) rather than a fill?
+ */
+static inline bool sbull_entry_has_data(void *entry)
+{
+        return !xa_is_value(entry) || sbull_is_evicted(entry);
+}
+
+/*
+ * New pages for the write path.  Reclaim from under a write can end up
+ * waiting on writeback, maybe to this very device, and is where the worst
+ * write latencies come from, so a page comes from this CPU's cache of
+ * pcp_pages pre-zeroed pages if it can, then from the page allocator
+ * without reclaim, and only then from a mempool whose page_reserve pages
+ * see us through until reclaim or the refill worker catches up.  The
+ * caches and the reserve are topped up by workers on sbull_alloc_wq,
+ * with GFP_NOIO so that their reclaim can't wait on I/O to us either.
+ * Pages come out zeroed.  Not for chunks or compression.
+ */
+#define SBULL_PCP_MAX           64
+
+struct sbull_pcp {
+        local_lock_t lock;
+        unsigned int nr;
+        struct page *pages[SBULL_PCP_MAX];
+        struct work_struct refill;
+        struct sbull_dev *dev;
+};
+
+static struct workqueue_struct *sbull_alloc_wq;
+
+static void sbull_pcp_refill(struct work_struct *work)
+{
+        struct sbull_pcp *pcp = container_of(work, struct sbull_pcp, refill);
+        struct sbull_dev *dev = pcp->dev;
+        struct page *pages[SBULL_PCP_MAX];
+        unsigned int n, want = pcp_pages - min_t(unsigned int, READ_ONCE(pcp->nr), pcp_pages);
+
+        for (n = 0; n < want; n++) {
+                pages[n] = alloc_pages_node(dev->node, GFP_NOIO | __GFP_ZERO | __GFP_NOWARN, 0);
+                if (!pages[n])
+                        break;
+        }
+
+        /* Bound work, but it may have moved if that CPU went offline. */
+        local_lock(&dev->pcp->lock);
+        pcp = this_cpu_ptr(dev->pcp);
+        while (n && pcp->nr < pcp_pages)
+                pcp->pages[pcp->nr++] = pages[--n];
+        local_unlock(&dev->pcp->lock);
+
+        while (n)
+                __free_page(pages[--n]);
+}
+
+static void sbull_pool_refill(struct work_struct *work)
+{
+        struct sbull_dev *dev = container_of(work, struct sbull_dev, pool_work);
+        mempool_t *pool = dev->page_pool;
+        struct page *page;
+
+        while (READ_ONCE(pool->curr_nr) < pool->min_nr) {
+                page = alloc_pages_node(dev->node, GFP_NOIO | __GFP_ZERO | __GFP_NOWARN, 0);
+                if (!page)
+                        break;          /* the next dip into the reserve retries */
+                mempool_free(page, pool);
+        }
+}
+
+static void *sbull_pool_alloc(gfp_t gfp, void *data)
+{
+        struct sbull_dev *dev = data;
+
+        return alloc_pages_node(dev->node, gfp | __GFP_ZERO, 0);
+}
+
+static void sbull_pool_free(void *element, void *data)
+{
+        __free_page(element);
+}
+
+static struct page *sbull_alloc_page(struct sbull_dev *dev)
+{
+        struct page *page = NULL;
+
+        if (dev->pcp) {
+                struct sbull_pcp *pcp;
+                bool low;
+                int cpu;
+
+                local_lock(&dev->pcp->lock);
+                pcp = this_cpu_ptr(dev->pcp);
+                cpu = smp_processor_id();
+                if (pcp->nr)
+                        page = pcp->pages[--pcp->nr];
+                low = pcp->nr < pcp_pages / 2;
+                local_unlock(&dev->pcp->lock);
+
+                if (low)
+                        queue_work_on(cpu, sbull_alloc_wq, &pcp->refill);
+                if (page) {
+                        this_cpu_inc(dev->stats->cache_allocs);
+                        return page;
+                }
+        }
+
+        if (!dev->page_pool)
+                return alloc_pages_node(dev->node, GFP_NOIO | __GFP_ZERO, 0);
+
+        /* Tries the allocator without reclaim before it takes from the pool. */
+        page = mempool_alloc(dev->page_pool, GFP_NOIO);
+        if (READ_ONCE(dev->page_pool->curr_nr) < dev->page_pool->min_nr)
+                queue_work(sbull_alloc_wq, &dev->pool_work);
+        return page;
+}
+
+/*
+ * Memory cap for devices with a backing_file.  Going over mem_limit_mb
+ * kicks the evictor; going well over it, when the evictor can't keep up,
+ * makes the writer wait for it rather than let memory run away.
+ */
+static void sbull_mem_check(struct sbull_dev *dev)
+{
+        s64 used;
+
+        if (!dev->backing)
+                return;
+        used = percpu_counter_read_positive(&dev->store.nr_pages);
+        if (used <= dev->mem_limit)
+                return;
+        queue_work_node(dev->node, system_unbound_wq, &dev->evict_work);
+        if (used > dev->mem_limit + dev->mem_limit / 8)
+                flush_work(&dev->evict_work);
+}
+
+static int sbull_read_backing(struct sbull_dev *dev, unsigned long idx, void *buf)
+{
+        loff_t pos = (loff_t)idx << PAGE_SHIFT;
+        unsigned int noio = memalloc_noio_save();
+        ssize_t n;
+
+        n = kernel_read(dev->backing, buf, PAGE_SIZE, &pos);
+        memalloc_noio_restore(noio);
+        if (n != PAGE_SIZE)
+                return n < 0 ? n : -EIO;
+        return 0;
+}
+
+/*
+ * Read evicted page @idx back in from the file.  Holding the shard's
+ * evict_sem keeps the evictor from moving the page out again, and
+ * writing a stale copy of it, before we have put it back.
+ */
+static int sbull_fault_in(struct sbull_dev *dev, unsigned long idx)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_shard(dev, idx, &key);
+        struct page *page;
+        void *cur;
+        int ret;
+
+        page = sbull_alloc_page(dev);
+        if (!page)
+                return -ENOMEM;
+
+        sbull_store_write_lock(&dev->store, idx);
+        if (xa_load(xa, key) != SBULL_EVICTED) {
+                ret = 0;                /* beaten to it */
+                goto out_free;
+        }
+        ret = sbull_read_backing(dev, idx, page_address(page));
+        if (ret)
+                goto out_free;
+        cur = xa_cmpxchg(xa, key, SBULL_EVICTED, page, GFP_NOIO);
+        if (cur != SBULL_EVICTED) {
+                ret = xa_err(cur);
+                goto out_free;
+        }
+        sbull_store_write_unlock(&dev->store, idx);
+
+        percpu_counter_inc(&dev->store.nr_pages);
+        percpu_counter_dec(&dev->nr_evicted);
+        this_cpu_inc(dev->stats->faults);
+        trace_sbull_page_alloc(idx, 0);
+        sbull_mem_check(dev);
+        return 0;
+
+out_free:
+        sbull_store_write_unlock(&dev->store, idx);
+        __free_page(page);
+        return ret;
+}
+
+/*
+ * Give page @idx a real page (or chunk) in place of @old, which is NULL
+ * or a fill entry, copying the fill into it, or SBULL_EVICTED, reading it
+ * back from the backing file.  A NULL @old on a device with snapshots
+ * starts as a copy of the page in the layers below, if there is one.
+ * Losing the race to another writer is fine: their entry is used
+ * instead.  May sleep, so it is called outside the RCU read-side section
+ * and the caller looks the page up again afterwards.
+ */
+static int sbull_insert_page(struct sbull_dev *dev, unsigned long idx,
+                             void *old)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_shard(dev, idx, &key);
+        struct page *page;
+        void *cur, *src = old;
+
+        if (sbull_is_evicted(old))
+                return sbull_fault_in(dev, idx);
+        if (!old && dev->top->parent) {
+                src = sbull_lookup_below(dev, idx);
+                if (src)
+                        this_cpu_inc(dev->stats->copyups);
+        }
+
+        if (dev->store.chunk_order)
+                page = alloc_pages_node(dev->node, GFP_NOIO | __GFP_ZERO | __GFP_COMP |
+                                        __GFP_NOWARN, dev->store.chunk_order);
+        else
+                page = sbull_alloc_page(dev);
+        if (!page)
+                return -ENOMEM;
+        this_cpu_inc(dev->stats->allocs);
+        trace_sbull_page_alloc(idx, dev->store.chunk_order);
+        if (xa_is_value(src))
+                memset32(page_address(page), sbull_entry_fill(src),
+                         PAGE_SIZE / sizeof(u32));
+        else if (src)
+                copy_page(page_address(page), page_address(src));
+
+        sbull_store_mark_dirty(&dev->store, idx);     /* the file has nothing of it yet */
+        cur = xa_cmpxchg(xa, key, old, page, GFP_NOIO);
+        if (cur != old) {
+                __free_pages(page, dev->store.chunk_order);
+                return xa_err(cur);
+        }
+        percpu_counter_inc(&dev->store.nr_pages);
+        if (old)
+                percpu_counter_dec(&dev->store.nr_same);
+        sbull_mem_check(dev);
+        return 0;
+}
+
+/*
+ * Compressed store (comp_algorithm=lz4, lzo, ...): every page is
+ * compressed through the crypto API and kept in a zsmalloc pool, and the
+ * index holds a small struct sbull_zobj for it.  Pages that do not
+ * shrink below SBULL_ZOBJ_HUGE are kept uncompressed in the pool.
+ * Compressed pages are never modified in place: a write builds a new
+ * object and swaps it into the index.
+ */
+#define SBULL_ZOBJ_HUGE         (PAGE_SIZE / 4 * 3)
+
+struct sbull_zobj {
+        unsigned long handle;           /* zsmalloc handle */
+        unsigned int len;               /* compressed size, PAGE_SIZE if raw */
+        struct llist_node free;         /* on dev->zfree once replaced */
+};
+
+static struct kmem_cache *sbull_zobj_cache;
+
+static void sbull_zobj_free(struct sbull_dev *dev, struct sbull_zobj *zobj)
+{
+        zs_free(dev->zpool, zobj->handle);
+        kmem_cache_free(sbull_zobj_cache, zobj);
+}
+
+/*
+ * zs_free() must not run from an RCU callback (softirq), so replaced
+ * objects are collected on dev->zfree and freed here in batches, one
+ * grace period per batch.
+ */
+static void sbull_zfree_work(struct work_struct *work)
+{
+        struct sbull_dev *dev = container_of(work, struct sbull_dev, zfree_work);
+        struct llist_node *list = llist_del_all(&dev->zfree);
+        struct sbull_zobj *zobj, *next;
+
+        if (!list)
+                return;
+
+        synchronize_rcu();
+        llist_for_each_entry_safe(zobj, next, list, free)
+                sbull_zobj_free(dev, zobj);
+}
+
+static void sbull_dput(struct sbull_dev *dev, struct page *page);
+
+static void sbull_free_page_rcu(struct rcu_head *head)
+{
+        struct page *page = container_of(head, struct page, rcu_head);
+
+        __free_pages(page, compound_order(page));
+}
+
+/*
+ * Account for an entry that has just been removed from the index and
+ * free it once no reader can still be using it.
+ */
+static void sbull_retire_entry(struct sbull_dev *dev, void *entry)
+{
+        if (sbull_is_evicted(entry)) {
+                percpu_counter_dec(&dev->nr_evicted);
+                return;
+        }
+        if (xa_is_value(entry)) {
+                percpu_counter_dec(&dev->store.nr_same);
+                return;
+        }
+
+        percpu_counter_dec(&dev->store.nr_pages);
+        if (dev->zpool) {
+                struct sbull_zobj *zobj = entry;
+
+                percpu_counter_sub(&dev->compr_bytes, zobj->len);
+                llist_add(&zobj->free, &dev->zfree);
+                schedule_work(&dev->zfree_work);
+        } else if (dev->dhash) {
+                sbull_dput(dev, entry);
+        } else {
+                struct page *page = entry;
+
+                call_rcu(&page->rcu_head, sbull_free_page_rcu);
+        }
+}
+
+/*
+ * The evictor, for devices with a backing_file: a clock over the index.
+ * The hand sweeps one shard at a time in key order, giving pages whose
+ * ref bit is set another round and collecting up to SBULL_EVICT_BATCH
+ * that have not been touched since it last passed.  Those are written
+ * back if dirty, runs of consecutive pages in one write, and replaced by
+ * SBULL_EVICTED, all under the shard's evict_sem so that no write lands
+ * in a page behind the copy.
+ */
+#define SBULL_EVICT_BATCH       32
+
+static int sbull_writeback(struct sbull_dev *dev, unsigned long idx,
+                           struct bio_vec *bv, unsigned int nr)
+{
+        loff_t pos = (loff_t)idx << PAGE_SHIFT;
+        struct iov_iter iter;
+        ssize_t n;
+
+        iov_iter_bvec(&iter, ITER_SOURCE, bv, nr, nr * PAGE_SIZE);
+        n = vfs_iter_write(dev->backing, &iter, &pos, 0);
+        if (n != nr * PAGE_SIZE)
+                return n < 0 ? n : -EIO;
+        this_cpu_add(dev->stats->writebacks, nr);
+        return 0;
+}
+
+static int sbull_evict_batch(struct sbull_dev *dev)
+{
+        unsigned int s = dev->hand_shard;
+        struct sbull_store_shard *shard = &dev->top->shards[s];
+        struct bio_vec bv[SBULL_EVICT_BATCH];
+        struct {
+                unsigned long key;
+                struct page *page;
+        } v[SBULL_EVICT_BATCH];
+        unsigned int i, j, k, nr = 0;
+        unsigned long key;
+        int evicted = 0;
+        void *entry;
+
+        xa_for_each_start(&shard->pages, key, entry, dev->hand_key) {
+                if (xa_is_value(entry))
+                        continue;
+                if (test_and_clear_bit(sbull_shard_idx(s, key), dev->store.ref))
+                        continue;       /* second chance */
+                v[nr++].key = key;
+                if (nr == SBULL_EVICT_BATCH)
+                        break;
+        }
+        if (nr == SBULL_EVICT_BATCH) {
+                dev->hand_key = key + 1;
+        } else {
+                dev->hand_key = 0;
+                dev->hand_shard = (s + 1) % SBULL_SHARDS;
+        }
+
+        down_write(&shard->evict_sem);
+
+        /* Pin them: a discard may still drop them from the index meanwhile. */
+        rcu_read_lock();
+        for (i = 0; i < nr; i++) {
+                entry = xa_load(&shard->pages, v[i].key);
+                v[i].page = entry && !xa_is_value(entry) ? entry : NULL;
+                if (v[i].page)
+                        get_page(v[i].page);
+        }
+        rcu_read_unlock();
+
+        for (i = 0; i < nr; i = j) {
+                unsigned long idx = sbull_shard_idx(s, v[i].key);
+
+                j = i + 1;
+                if (!v[i].page || !test_bit(idx, dev->store.dirty))
+                        continue;       /* the file has it already */
+                while (j < nr && v[j].page &&
+                       sbull_shard_idx(s, v[j].key) == idx + j - i &&
+                       test_bit(idx + j - i, dev->store.dirty))
+                        j++;
+
+                for (k = i; k < j; k++)
+                        bvec_set_page(&bv[k - i], v[k].page, PAGE_SIZE, 0);
+                if (sbull_writeback(dev, idx, bv, j - i)) {
+                        for (k = i; k < j; k++) {       /* keep them, then */
+                                put_page(v[k].page);
+                                v[k].page = NULL;
+                        }
+                        continue;
+                }
+                for (k = i; k < j; k++)
+                        clear_bit(idx + k - i, dev->store.dirty);
+        }
+
+        for (i = 0; i < nr; i++) {
+                struct page *page = v[i].page;
+
+                if (!page)
+                        continue;
+                if (xa_cmpxchg(&shard->pages, v[i].key, page, SBULL_EVICTED,
+                               GFP_NOIO) == page) {
+                        sbull_retire_entry(dev, page);
+                        percpu_counter_inc(&dev->nr_evicted);
+                        this_cpu_inc(dev->stats->evictions);
+                        evicted++;
+                }
+                put_page(page);
+        }
+
+        up_write(&shard->evict_sem);
+        return evicted;
+}
+
+/*
+ * Evict down to 15/16 of the limit.  Gives up after the hand has gone
+ * round twice without finding anything to evict.
+ */
+static void sbull_evict_work(struct work_struct *work)
+{
+        struct sbull_dev *dev = container_of(work, struct sbull_dev, evict_work);
+        unsigned long low = dev->mem_limit - dev->mem_limit / 16;
+        unsigned int idle = 0, noio = memalloc_noio_save();
+
+        while (percpu_counter_read_positive(&dev->store.nr_pages) > low &&
+               idle < 2 * SBULL_SHARDS) {
+                unsigned int shard = dev->hand_shard;
+
+                if (sbull_evict_batch(dev))
+                        idle = 0;
+                else if (dev->hand_shard != shard)
+                        idle++;
+                cond_resched();
+        }
+        memalloc_noio_restore(noio);
+}
+
+/*
+ * Decompress @zobj and copy @len bytes at @off of it to @buf.  Called
+ * under rcu_read_lock().
+ */
+static int sbull_zread(struct sbull_dev *dev, struct sbull_zobj *zobj,
+                       unsigned int off, char *buf, unsigned int len)
+{
+        struct sbull_zstrm *zstrm;
+        unsigned int dlen = PAGE_SIZE;
+        u8 *src, *dst;
+        u64 start;
+        int ret;
+
+        if (zobj->len == PAGE_SIZE) {
+                src = zs_map_object(dev->zpool, zobj->handle, ZS_MM_RO);
+                memcpy(buf, src + off, len);
+                zs_unmap_object(dev->zpool, zobj->handle);
+                return 0;
+        }
+
+        local_lock(&dev->zstrm->lock);
+        zstrm = this_cpu_ptr(dev->zstrm);
+        /* Decompress straight into @buf when the whole page is wanted. */
+        dst = len == PAGE_SIZE ? (u8 *)buf : zstrm->buffer;
+
+        src = zs_map_object(dev->zpool, zobj->handle, ZS_MM_RO);
+        start = ktime_get_ns();
+        ret = crypto_comp_decompress(zstrm->tfm, src, zobj->len, dst, &dlen);
+        zstrm->decomp_ns += ktime_get_ns() - start;
+        zstrm->decomp_ops++;
+        zs_unmap_object(dev->zpool, zobj->handle);
+
+        if (!ret && dst != (u8 *)buf)
+                memcpy(buf, dst + off, len);
+        local_unlock(&dev->zstrm->lock);
+
+        if (ret || dlen != PAGE_SIZE) {
+                pr_err_ratelimited("sbull: corrupt compressed page\n");
+                return -EIO;
+        }
+        return 0;
+}
+
+static int sbull_read_page(struct sbull_dev *dev, unsigned long idx,
+                           unsigned int off, char *buf, unsigned int len);
+
+/*
+ * Compress a page into a new object and swap it in for page @idx.
+ * Partial writes are a read-modify-write of the whole page.
+ */
+static int sbull_zwrite(struct sbull_dev *dev, unsigned long idx,
+                        unsigned int off, const char *buf, unsigned int len)
+{
+        unsigned long key, handle = 0;
+        struct xarray *xa = sbull_shard(dev, idx, &key);
+        struct sbull_zstrm *zstrm;
+        struct sbull_zobj *zobj;
+        struct page *tmp = NULL;
+        const u8 *src = buf;
+        unsigned int clen;
+        void *dst, *old;
+        u64 start;
+        int ret;
+
+        if (len != PAGE_SIZE) {
+                tmp = alloc_page(GFP_NOIO);
+                if (!tmp)
+                        return -ENOMEM;
+                ret = sbull_read_page(dev, idx, 0, page_address(tmp), PAGE_SIZE);
+                if (ret)
+                        goto out;
+                memcpy(page_address(tmp) + off, buf, len);
+                src = page_address(tmp);
+        }
+
+        zobj = kmem_cache_alloc_node(sbull_zobj_cache, GFP_NOIO, dev->node);
+        if (!zobj) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+compress_again:
+        local_lock(&dev->zstrm->lock);
+        zstrm = this_cpu_ptr(dev->zstrm);
+        clen = 2 * PAGE_SIZE;
+        start = ktime_get_ns();
+        ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE, zstrm->buffer, &clen);
+        zstrm->comp_ns += ktime_get_ns() - start;
+        zstrm->comp_ops++;
+        if (ret || clen >= SBULL_ZOBJ_HUGE)
+                clen = PAGE_SIZE;       /* not worth it, keep it raw */
+
+        if (!handle) {
+                handle = zs_malloc(dev->zpool, clen, __GFP_KSWAPD_RECLAIM |
+                                   __GFP_NOWARN | __GFP_HIGHMEM | __GFP_MOVABLE);
+                if (IS_ERR_VALUE(handle)) {
+                        /*
+                         * Can't sleep holding the stream: allocate with
+                         * reclaim, then compress again (same input, so
+                         * same size) on whatever CPU we end up on.
+                         */
+                        local_unlock(&dev->zstrm->lock);
+                        handle = zs_malloc(dev->zpool, clen, GFP_NOIO |
+                                           __GFP_HIGHMEM | __GFP_MOVABLE);
+                        if (IS_ERR_VALUE(handle)) {
+                                kmem_cache_free(sbull_zobj_cache, zobj);
+                                ret = -ENOMEM;
+                                goto out;
+                        }
+                        goto compress_again;
+                }
+        }
+
+        dst = zs_map_object(dev->zpool, handle, ZS_MM_WO);
+        memcpy(dst, clen == PAGE_SIZE ? src : zstrm->buffer, clen);
+        zs_unmap_object(dev->zpool, handle);
+        local_unlock(&dev->zstrm->lock);
+
+        zobj->handle = handle;
+        zobj->len = clen;
+        old = xa_store(xa, key, zobj, GFP_NOIO);
+        if (xa_is_err(old)) {
+                ret = xa_err(old);
+                sbull_zobj_free(dev, zobj);
+                goto out;
+        }
+        percpu_counter_inc(&dev->store.nr_pages);
+        percpu_counter_add(&dev->compr_bytes, clen);
+        this_cpu_inc(dev->stats->allocs);
+        trace_sbull_page_alloc(idx, 0);
+        if (old)
+                sbull_retire_entry(dev, old);
+        ret = 0;
+out:
+        if (tmp)
+                __free_page(tmp);
+        return ret;
+}
+
+/*
+ * Dedup store (dedup=1): pages are keyed by an xxh64 of their contents
+ * in a per-device hash table, and index slots holding identical data
+ * share one page.  page->private points back at the page's
+ * struct sbull_dnode, which counts the slots using it.  Shared pages are
+ * never written in place: a write looks its new contents up (or stores
+ * them afresh) and swaps the result into the index.
+ */
+struct sbull_dnode {
+        struct hlist_node hnode;        /* in dev->dhash[hash & dhash_mask] */
+        u64 hash;
+        struct page *page;
+        refcount_t refs;                /* index slots pointing at @page */
+        struct rcu_head rcu;
+};
+
+struct sbull_dbucket {
+        spinlock_t lock;
+        struct hlist_head head;
+};
+
+static struct kmem_cache *sbull_dnode_cache;
+
+static struct sbull_dbucket *sbull_dbucket(struct sbull_dev *dev, u64 hash)
+{
+        return &dev->dhash[hash & dev->dhash_mask];
+}
+
+static void sbull_dnode_free_rcu(struct rcu_head *head)
+{
+        struct sbull_dnode *dn = container_of(head, struct sbull_dnode, rcu);
+
+        __free_page(dn->page);
+        kmem_cache_free(sbull_dnode_cache, dn);
+}
+
+/*
+ * Drop one index slot's reference on a dedup page; the last one takes
+ * it out of the hash table and frees it after a grace period.
+ */
+static void sbull_dput(struct sbull_dev *dev, struct page *page)
+{
+        struct sbull_dnode *dn = (struct sbull_dnode *)page_private(page);
+        struct sbull_dbucket *b = sbull_dbucket(dev, dn->hash);
+
+        if (!refcount_dec_and_lock(&dn->refs, &b->lock))
+                return;
+        hlist_del(&dn->hnode);
+        spin_unlock(&b->lock);
+
+        percpu_counter_dec(&dev->nr_unique);
+        call_rcu(&dn->rcu, sbull_dnode_free_rcu);
+}
+
+/*
+ * Find a page holding exactly @src and take a reference on it, or store
+ * @src in a new one.
+ */
+static struct page *sbull_dget(struct sbull_dev *dev, const void *src)
+{
+        u64 hash = xxh64(src, PAGE_SIZE, 0);
+        struct sbull_dbucket *b = sbull_dbucket(dev, hash);
+        struct sbull_dnode *dn;
+
+        spin_lock(&b->lock);
+        hlist_for_each_entry(dn, &b->head, hnode) {
+                if (dn->hash == hash &&
+                    !memcmp(page_address(dn->page), src, PAGE_SIZE)) {
+                        refcount_inc(&dn->refs);
+                        spin_unlock(&b->lock);
+                        percpu_counter_inc(&dev->dedup_hits);
+                        return dn->page;
+                }
+        }
+        spin_unlock(&b->lock);
+
+        dn = kmem_cache_alloc_node(sbull_dnode_cache, GFP_NOIO, dev->node);
+        if (!dn)
+                return NULL;
+        dn->page = sbull_alloc_page(dev);
+        if (!dn->page) {
+                kmem_cache_free(sbull_dnode_cache, dn);
+                return NULL;
+        }
+        this_cpu_inc(dev->stats->allocs);
+        memcpy(page_address(dn->page), src, PAGE_SIZE);
+        set_page_private(dn->page, (unsigned long)dn);
+        dn->hash = hash;
+        refcount_set(&dn->refs, 1);
+
+        /*
+         * Someone may have stored the same data meanwhile; that only
+         * costs a duplicate, so don't bother looking again.
+         */
+        spin_lock(&b->lock);
+        hlist_add_head(&dn->hnode, &b->head);
+        spin_unlock(&b->lock);
+        percpu_counter_inc(&dev->nr_unique);
+        return dn->page;
+}
+
+/*
+ * Point page @idx at a shared copy of the new data.  Partial writes are
+ * a read-modify-write of the whole page.
+ */
+static int sbull_dwrite(struct sbull_dev *dev, unsigned long idx,
+                        unsigned int off, const char *buf, unsigned int len)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_shard(dev, idx, &key);
+        struct page *page, *tmp = NULL;
+        const char *src = buf;
+        void *old;
+        int ret = 0;
+
+        if (len != PAGE_SIZE) {
+                tmp = alloc_page(GFP_NOIO);
+                if (!tmp)
+                        return -ENOMEM;
+                ret = sbull_read_page(dev, idx, 0, page_address(tmp), PAGE_SIZE);
+                if (ret)
+                        goto out;
+                memcpy(page_address(tmp) + off, buf, len);
+                src = page_address(tmp);
+        }
+
+        page = sbull_dget(dev, src);
+        if (!page) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        old = xa_store(xa, key, page, GFP_NOIO);
+        if (xa_is_err(old)) {
+                ret = xa_err(old);
+                sbull_dput(dev, page);
+                goto out;
+        }
+        percpu_counter_inc(&dev->store.nr_pages);
+        if (old)
+                sbull_retire_entry(dev, old);
+out:
+        if (tmp)
+                __free_page(tmp);
+        return ret;
+}
+
+/*
+ * Remove page @idx from the index, if present.
+ */
+static int sbull_delete_entry(struct sbull_dev *dev, unsigned long idx)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_shard(dev, idx, &key);
+        void *entry;
+
+        entry = xa_erase(xa, key);
+        if (entry)
+                sbull_retire_entry(dev, entry);
+        return 0;
+}
+
+/*
+ * Plain pages and chunks are the store core's (sbull_store.c); the
+ * per-page paths here are for compressed and dedup devices, and pass
+ * the rest on to it.
+ */
+static inline bool sbull_in_store(struct sbull_dev *dev)
+{
+        return !dev->zpool && !dev->dhash;
+}
+
+/*
+ * Copy @len bytes at @off of entry @idx to @buf.
+ */
+static int sbull_read_page(struct sbull_dev *dev, unsigned long idx,
+                           unsigned int off, char *buf, unsigned int len)
+{
+        void *entry;
+        int ret = 0;
+
+        if (sbull_in_store(dev))
+                return sbull_store_read(&dev->store, (idx << dev->store.chunk_shift) + off,
+                                        buf, len);
+
+        rcu_read_lock();
+        entry = sbull_lookup_entry(dev, idx);
+        if (!entry)
+                memset(buf, 0, len);    /* never written or discarded: reads as zeroes */
+        else if (xa_is_value(entry))
+                memset32((u32 *)buf, sbull_entry_fill(entry), len / sizeof(u32));
+        else if (dev->zpool)
+                ret = sbull_zread(dev, entry, off, buf, len);
+        else
+                memcpy(buf, page_address(entry) + off, len);
+        rcu_read_unlock();
+
+        return ret;
+}
+
+/*
+ * Copy @len bytes from @buf to @off of entry @idx, allocating it first
+ * if need be.  Whole same-filled pages are only recorded, not stored.
+ */
+static int sbull_write_page(struct sbull_dev *dev, unsigned long idx,
+                            unsigned int off, const char *buf, unsigned int len)
+{
+        u32 fill;
+
+        if (sbull_in_store(dev))
+                return sbull_store_write(&dev->store, (idx << dev->store.chunk_shift) + off,
+                                         buf, len);
+
+        if (len == PAGE_SIZE && sbull_page_same_filled(buf, &fill))
+                return sbull_store_fill(&dev->store, idx, fill, GFP_NOIO);
+        if (dev->zpool)
+                return sbull_zwrite(dev, idx, off, buf, len);
+        return sbull_dwrite(dev, idx, off, buf, len);
+}
+
+/*
+ * Zero @len bytes at @off of page @idx, if it is present at all.
+ */
+static int sbull_zero_partial(struct sbull_dev *dev, unsigned long idx,
+                              unsigned int off, unsigned int len)
+{
+        bool present;
+
+        rcu_read_lock();
+        present = sbull_lookup_entry(dev, idx) != NULL;
+        rcu_read_unlock();
+        if (!present)
+                return 0;
+        return sbull_write_page(dev, idx, off, page_address(ZERO_PAGE(0)), len);
+}
+
+/*
+ * Discard and write-zeroes: whole entries are dropped from the index,
+ * and partially covered ones are zeroed.  Either way the range then
+ * reads back as zeroes.
+ */
+static int sbull_discard(struct sbull_dev *dev, unsigned long sector,
+                         unsigned long nsect)
+{
+        unsigned long offset = sector * KERNEL_SECTOR_SIZE;
+        unsigned long nbytes = nsect * KERNEL_SECTOR_SIZE;
+        int ret;
+
+        if ((offset + nbytes) > dev->size)
+                return -EIO;    /* beyond end */
+        if (sbull_in_store(dev))
+                return sbull_store_discard(&dev->store, offset, nbytes);
+
+        while (nbytes) {
+                unsigned long idx = offset >> PAGE_SHIFT;
+                unsigned int off = offset_in_page(offset);
+                unsigned int len = min(nbytes, PAGE_SIZE - off);
+
+                if (len == PAGE_SIZE)
+                        ret = sbull_delete_entry(dev, idx);
+                else
+                        ret = sbull_zero_partial(dev, idx, off, len);
+                if (ret)
+                        return ret;
+
+                offset += len;
+                nbytes -= len;
+        }
+        return 0;
+}
+
+/*
+ * Drop every entry from the device's own layer and free it.  Only called
+ * once no more I/O can arrive.  Frozen layers go with the last reference
+ * to them.
+ */
+static void sbull_free_entries(struct sbull_dev *dev)
+{
+        unsigned long key;
+        void *entry;
+        int i;
+
+        for (i = 0; i < SBULL_SHARDS; i++) {
+                struct xarray *xa = &dev->top->shards[i].pages;
+
+                xa_for_each(xa, key, entry) {
+                        xa_erase(xa, key);
+                        if (sbull_is_evicted(entry)) {
+                                percpu_counter_dec(&dev->nr_evicted);
+                                continue;
+                        }
+                        if (xa_is_value(entry)) {
+                                percpu_counter_dec(&dev->store.nr_same);
+                                continue;
+                        }
+                        percpu_counter_dec(&dev->store.nr_pages);
+                        if (dev->zpool) {
+                                percpu_counter_sub(&dev->compr_bytes,
+                                                   ((struct sbull_zobj *)entry)->len);
+                                sbull_zobj_free(dev, entry);
+                        } else if (dev->dhash) {
+                                sbull_dput(dev, entry);
+                        } else {
+                                __free_pages(entry, dev->store.chunk_order);
+                        }
+                }
+                xa_destroy(xa);
+        }
+}
+
+static int sbull_transfer(struct sbull_dev *dev, unsigned long sector,
+                          unsigned long nsect, char *buffer, int write)
+{
+        unsigned long offset = sector * KERNEL_SECTOR_SIZE;
+        unsigned long nbytes = nsect * KERNEL_SECTOR_SIZE;
+        int ret;
+
+        if ((offset + nbytes) > dev->size)
+                return -EIO;    /* beyond end */
+
+        /* A segment may straddle entries, so walk it one entry at a time. */
+        while (nbytes) {
+                unsigned long chunk = 1UL << dev->store.chunk_shift;
+                unsigned long idx = offset >> dev->store.chunk_shift;
+                unsigned int off = offset & (chunk - 1);
+                unsigned int len = min(nbytes, chunk - off);
+
+                if (write)
+                        ret = sbull_write_page(dev, idx, off, buffer, len);
+                else
+                        ret = sbull_read_page(dev, idx, off, buffer, len);
+                if (ret)
+                        return ret;
+
+                offset += len;
+                buffer += len;
+                nbytes -= len;
+        }
+        return 0;
+}
+
+/*
+ * Plain pages and chunks go through the store core, which walks the
+ * index a window at a time.  These are what the device adds to it.
+ */
+static int sbull_op_insert(struct sbull_store *s, unsigned long idx, void *old)
+{
+        return sbull_insert_page(container_of(s, struct sbull_dev, store), idx, old);
+}
+
+static void sbull_op_retire(struct sbull_store *s, void *entry)
+{
+        sbull_retire_entry(container_of(s, struct sbull_dev, store), entry);
+}
+
+/*
+ * For a read, fill the window's holes from the frozen layers below,
+ * nearest first.
+ */
+static void sbull_op_lookup_below(struct sbull_store *s, unsigned long base, void **win)
+{
+        struct sbull_dev *dev = container_of(s, struct sbull_dev, store);
+        struct sbull_layer *l;
+        unsigned int i;
+
+        for (l = dev->top->parent; l; l = l->parent) {
+                unsigned long key;
+                struct xarray *xa = sbull_layer_shard(l, base, &key);
+                XA_STATE(xas, xa, key);
+                void *entry;
+
+                for (i = 0; i < SBULL_BATCH && win[i]; i++)
+                        ;
+                if (i == SBULL_BATCH)
+                        return;         /* no holes left */
+                sbull_account_lookup(dev, xa);
+                xas_for_each(&xas, entry, key + SBULL_BATCH - 1) {
+                        if (xas_retry(&xas, entry))
+                                continue;
+                        if (!win[xas.xa_index - key])
+                                win[xas.xa_index - key] = entry;
+                }
+        }
+}
+
+static void sbull_op_walked(struct sbull_store *s, struct xarray *xa, unsigned long base,
+                            void **win)
+{
+        struct sbull_dev *dev = container_of(s, struct sbull_dev, store);
+        unsigned int i;
+
+        sbull_account_lookup(dev, xa);
+        if (!trace_sbull_lookup_hit_enabled() && !trace_sbull_lookup_miss_enabled())
+                return;
+        for (i = 0; i < SBULL_BATCH; i++) {
+                if (win[i])
+                        trace_sbull_lookup_hit(base + i);
+                else
+                        trace_sbull_lookup_miss(base + i);
+        }
+}
+
+static const struct sbull_store_ops sbull_dev_store_ops = {
+        .insert = sbull_op_insert,
+        .retire = sbull_op_retire,
+        .lookup_below = sbull_op_lookup_below,
+        .walked = sbull_op_walked,
+};
+
+/*
+ * Big sequential transfers would otherwise sweep the whole LLC, evicting
+ * everything else on the socket for data nobody is going to look at
+ * again soon.  Bios of nt_copy_kb or more are copied with non-temporal
+ * stores instead: written pages go straight to memory, and so does what
+ * a read copies out.  Smaller ones, the likelier to be hot, keep the
+ * ordinary cached memcpy().  Where the architecture has no such copy,
+ * memcpy_flushcache() is memcpy().
+ */
+static inline bool sbull_copy_nt(unsigned int bytes)
+{
+        unsigned int kb = READ_ONCE(nt_copy_kb);
+
+        return kb && bytes >= (kb << 10);
+}
+
+static int sbull_xfer_bio_fast(struct sbull_dev *dev, struct bio *bio)
+{
+        bool nt = sbull_copy_nt(bio->bi_iter.bi_size);
+        int ret;
+
+        if (op_is_write(bio_op(bio)))
+                ret = sbull_store_write_bvec(&dev->store, bio->bi_io_vec, bio->bi_iter, nt);
+        else
+                ret = sbull_store_read_bvec(&dev->store, bio->bi_io_vec, bio->bi_iter, nt);
+
+        if (nt) {
+                this_cpu_inc(dev->stats->nt_ios);
+                this_cpu_add(dev->stats->nt_bytes, bio->bi_iter.bi_size);
+        } else {
+                this_cpu_inc(dev->stats->copy_ios);
+                this_cpu_add(dev->stats->copy_bytes, bio->bi_iter.bi_size);
+        }
+        return ret;
+}
+
+/*
+ * Transfer a single BIO.
+ */
+static blk_status_t __sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
+{
+        struct bvec_iter iter;
+        struct bio_vec bvec;
+        sector_t sector = bio->bi_iter.bi_sector;
+        int ret = 0;
+
+        switch (bio_op(bio)) {
+        case REQ_OP_DISCARD:
+        case REQ_OP_WRITE_ZEROES:
+                return errno_to_blk_status(sbull_discard(dev, sector, bio_sectors(bio)));
+        default:
+                break;
+        }
+
+        if (sbull_in_store(dev))
+                return errno_to_blk_status(sbull_xfer_bio_fast(dev, bio));
+
+        // Process each and every segment
+        bio_for_each_segment(bvec, bio, iter) {
+                // Map a kernel page for I/O (not atomic: inserting a page may sleep)
+                char *buffer = kmap_local_page(bvec.bv_page) + bvec.bv_offset;
+                // Read from or write to the buffer
+                ret = sbull_transfer(dev, sector, bvec.bv_len >> 9, buffer, bio_data_dir(bio) == WRITE);
+                sector += bvec.bv_len >> 9;
+                // Free the mapped kernel page
+                kunmap_local(buffer);
+                if (ret)
+                        break;
+        }
+
+        return errno_to_blk_status(ret);
+}
+
+/*
+ * Zoned mode (zoned=1): a host-managed zoned device of zone_size_mb
+ * zones, the first zone_nr_conv of them conventional and the rest
+ * sequential-write-required, with zone_capacity_mb of each writable.
+ * A sequential zone keeps its condition and write pointer under its own
+ * mutex, held across a write so that the pointer only moves once the
+ * data is in.  Writes must land at the write pointer; REQ_OP_ZONE_APPEND
+ * writes there and reports where.  Resetting a zone frees its pages, so
+ * a zone written, reset and written again costs what a fresh one does,
+ * as on a real device.  zone_max_open and zone_max_active, if set, are
+ * enforced as the ZNS limits are: opening a zone past zone_max_open
+ * implicitly closes an implicitly open one, and only fails if all the
+ * open zones were opened explicitly.  That close happens under
+ * zone_res_lock alone, so a condition read under just the zone's mutex
+ * may have gone from implicitly open to closed behind it.
+ */
+struct sbull_zone {
+        struct mutex lock;
+        sector_t start;
+        sector_t wp;
+        enum blk_zone_type type;
+        enum blk_zone_cond cond;
+};
+
+static inline bool sbull_zone_is_open(enum blk_zone_cond cond)
+{
+        return cond == BLK_ZONE_COND_IMP_OPEN || cond == BLK_ZONE_COND_EXP_OPEN;
+}
+
+static inline bool sbull_zone_is_active(enum blk_zone_cond cond)
+{
+        return sbull_zone_is_open(cond) || cond == BLK_ZONE_COND_CLOSED;
+}
+
+/*
+ * Give back an open zone resource by closing an implicitly open zone, as
+ * a host-managed device does when it needs one.  A write already under
+ * way to that zone still lands, and the one after it opens the zone
+ * again.  Called under zone_res_lock.
+ */
+static bool sbull_zone_close_imp(struct sbull_dev *dev)
+{
+        unsigned int i;
+
+        for (i = dev->zone_nr_conv; i < dev->nr_zones; i++) {
+                struct sbull_zone *z = &dev->zones[i];
+
+                if (z->cond == BLK_ZONE_COND_IMP_OPEN) {
+                        WRITE_ONCE(z->cond, BLK_ZONE_COND_CLOSED);
+                        dev->nr_open--;
+                        return true;
+                }
+        }
+        return false;
+}
+
+/*
+ * Move zone @z to @cond, taking or giving back open and active zone
+ * resources as that needs.  Called under the zone's lock.
+ */
+static blk_status_t sbull_zone_cond(struct sbull_dev *dev, struct sbull_zone *z,
+                                    enum blk_zone_cond cond)
+{
+        blk_status_t ret = BLK_STS_OK;
+        int open, active;
+
+        spin_lock(&dev->zone_res_lock);
+        open = sbull_zone_is_open(cond) - sbull_zone_is_open(z->cond);
+        active = sbull_zone_is_active(cond) - sbull_zone_is_active(z->cond);
+        if (active > 0 && zone_max_active && dev->nr_active >= zone_max_active) {
+                ret = BLK_STS_ZONE_ACTIVE_RESOURCE;
+        } else if (open > 0 && zone_max_open && dev->nr_open >= zone_max_open &&
+                   !sbull_zone_close_imp(dev)) {
+                ret = BLK_STS_ZONE_OPEN_RESOURCE;
+        } else {
+                dev->nr_open += open;
+                dev->nr_active += active;
+                WRITE_ONCE(z->cond, cond);
+        }
+        spin_unlock(&dev->zone_res_lock);
+        return ret;
+}
+
+static struct sbull_zone *sbull_zone(struct sbull_dev *dev, sector_t sector)
+{
+        if (sector >= (dev->size >> SECTOR_SHIFT))
+                return NULL;
+        return &dev->zones[sector >> dev->zone_shift];
+}
+
+static blk_status_t sbull_zone_write(struct sbull_dev *dev, struct bio *bio)
+{
+        struct sbull_zone *z = sbull_zone(dev, bio->bi_iter.bi_sector);
+        bool append = bio_op(bio) == REQ_OP_ZONE_APPEND;
+        unsigned int nr = bio_sectors(bio);
+        blk_status_t ret;
+
+        if (!z)
+                return BLK_STS_IOERR;
+        if (z->type == BLK_ZONE_TYPE_CONVENTIONAL)
+                return append ? BLK_STS_IOERR : __sbull_xfer_bio(dev, bio);
+
+        mutex_lock(&z->lock);
+        if (append)
+                bio->bi_iter.bi_sector = z->wp; /* and that is what completes */
+        ret = BLK_STS_IOERR;
+        if (z->cond == BLK_ZONE_COND_FULL || bio->bi_iter.bi_sector != z->wp ||
+            z->wp + nr > z->start + dev->zone_cap)
+                goto out;
+        if (!sbull_zone_is_open(READ_ONCE(z->cond))) {
+                ret = sbull_zone_cond(dev, z, BLK_ZONE_COND_IMP_OPEN);
+                if (ret)
+                        goto out;
+        }
+
+        ret = __sbull_xfer_bio(dev, bio);
+        if (ret)
+                goto out;
+        z->wp += nr;
+        if (z->wp == z->start + dev->zone_cap)
+                sbull_zone_cond(dev, z, BLK_ZONE_COND_FULL);
+out:
+        mutex_unlock(&z->lock);
+        return ret;
+}
+
+static blk_status_t sbull_zone_mgmt(struct sbull_dev *dev, enum req_op op,
+                                    sector_t sector)
+{
+        struct sbull_zone *z;
+        blk_status_t ret = BLK_STS_OK;
+        unsigned int i;
+
+        if (op == REQ_OP_ZONE_RESET_ALL) {
+                for (i = dev->zone_nr_conv; i < dev->nr_zones && !ret; i++)
+                        ret = sbull_zone_mgmt(dev, REQ_OP_ZONE_RESET, dev->zones[i].start);
+                return ret;
+        }
+
+        z = sbull_zone(dev, sector);
+        if (!z || z->type == BLK_ZONE_TYPE_CONVENTIONAL)
+                return BLK_STS_IOERR;
+
+        mutex_lock(&z->lock);
+        switch (op) {
+        case REQ_OP_ZONE_RESET:
+                if (z->wp != z->start)
+                        ret = errno_to_blk_status(sbull_discard(dev, z->start, z->wp - z->start));
+                if (ret)
+                        break;
+                z->wp = z->start;
+                sbull_zone_cond(dev, z, BLK_ZONE_COND_EMPTY);
+                break;
+        case REQ_OP_ZONE_OPEN:
+                if (z->cond != BLK_ZONE_COND_FULL)
+                        ret = sbull_zone_cond(dev, z, BLK_ZONE_COND_EXP_OPEN);
+                break;
+        case REQ_OP_ZONE_CLOSE:
+                if (sbull_zone_is_open(READ_ONCE(z->cond)))
+                        sbull_zone_cond(dev, z, z->wp == z->start ? BLK_ZONE_COND_EMPTY :
+                                                                    BLK_ZONE_COND_CLOSED);
+                break;
+        case REQ_OP_ZONE_FINISH:
+                z->wp = z->start + (1ULL << dev->zone_shift);
+                sbull_zone_cond(dev, z, BLK_ZONE_COND_FULL);
+                break;
+        default:
+                ret = BLK_STS_NOTSUPP;
+                break;
+        }
+        mutex_unlock(&z->lock);
+        return ret;
+}
+
+static blk_status_t sbull_zone_bio(struct sbull_dev *dev, struct bio *bio)
+{
+        if (op_is_zone_mgmt(bio_op(bio)))
+                return sbull_zone_mgmt(dev, bio_op(bio), bio->bi_iter.bi_sector);
+        if (op_is_write(bio_op(bio)))
+                return sbull_zone_write(dev, bio);
+        return __sbull_xfer_bio(dev, bio);
+}
+
+static int sbull_report_zones(struct gendisk *disk, sector_t sector,
+                              unsigned int nr_zones, report_zones_cb cb, void *data)
+{
+        struct sbull_dev *dev = disk->private_data;
+        unsigned int i, first = sector >> dev->zone_shift;
+        int ret;
+
+        if (!dev->zones)
+                return -EOPNOTSUPP;
+
+        for (i = 0; i < nr_zones && first + i < dev->nr_zones; i++) {
+                struct sbull_zone *z = &dev->zones[first + i];
+                struct blk_zone blkz = {
+                        .start = z->start,
+                        .len = 1ULL << dev->zone_shift,
+                        .type = z->type,
+                };
+
+                mutex_lock(&z->lock);
+                blkz.wp = z->wp;
+                blkz.cond = READ_ONCE(z->cond);
+                mutex_unlock(&z->lock);
+                blkz.capacity = z->type == BLK_ZONE_TYPE_CONVENTIONAL ? blkz.len : dev->zone_cap;
+
+                ret = cb(&blkz, i, data);
+                if (ret)
+                        return ret;
+        }
+        return i;
+}
+
+/*
+ * Carve the device into zones, dropping any tail too short for a whole
+ * one.
+ */
+static int sbull_init_zones(struct sbull_dev *dev)
+{
+        sector_t len = (sector_t)zone_size_mb << (20 - SECTOR_SHIFT);
+        unsigned int i;
+
+        dev->zone_shift = ilog2(len);
+        dev->zone_cap = zone_capacity_mb ? (sector_t)zone_capacity_mb << (20 - SECTOR_SHIFT) : len;
+        dev->nr_zones = (dev->size >> SECTOR_SHIFT) >> dev->zone_shift;
+        dev->zone_nr_conv = zone_nr_conv;
+        if (!dev->nr_zones || dev->zone_nr_conv >= dev->nr_zones) {
+                pr_err("sbull: sbull%d has room for %u zones, not enough\n",
+                       dev->index, dev->nr_zones);
+                return -EINVAL;
+        }
+        dev->size = (unsigned long)dev->nr_zones << (dev->zone_shift + SECTOR_SHIFT);
+        dev->store.size = dev->size;
+
+        dev->zones = kvzalloc_node(array_size(dev->nr_zones, sizeof(*dev->zones)),
+                                   GFP_KERNEL, dev->node);
+        if (!dev->zones)
+                return -ENOMEM;
+        spin_lock_init(&dev->zone_res_lock);
+        for (i = 0; i < dev->nr_zones; i++) {
+                struct sbull_zone *z = &dev->zones[i];
+
+                mutex_init(&z->lock);
+                z->start = z->wp = (sector_t)i << dev->zone_shift;
+                if (i < dev->zone_nr_conv) {
+                        z->wp += len;   /* as reported for a zone with none */
+                        z->type = BLK_ZONE_TYPE_CONVENTIONAL;
+                        z->cond = BLK_ZONE_COND_NOT_WP;
+                } else {
+                        z->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+                        z->cond = BLK_ZONE_COND_EMPTY;
+                }
+        }
+        return 0;
+}
+
+static inline unsigned int sbull_lat_bucket(u64 ns)
+{
+        return ns ? min_t(unsigned int, ilog2(ns), SBULL_LAT_BUCKETS - 1) : 0;
+}
+
+/*
+ * Transfer a BIO and account for it in this CPU's statistics.
+ */
+static blk_status_t sbull_xfer_bio(struct sbull_dev *dev, struct bio *bio)
+{
+        unsigned int bytes = bio->bi_iter.bi_size;
+        sector_t sector = bio->bi_iter.bi_sector;
+        struct sbull_stats *stats;
+        blk_status_t status;
+        u64 start, ns;
+        int op;
+
+        switch (bio_op(bio)) {
+        case REQ_OP_DISCARD:
+        case REQ_OP_WRITE_ZEROES:
+                op = SBULL_STAT_DISCARD;
+                break;
+        default:
+                if (op_is_zone_mgmt(bio_op(bio)))
+                        op = SBULL_STAT_DISCARD;
+                else
+                        op = op_is_write(bio_op(bio)) ? SBULL_STAT_WRITE : SBULL_STAT_READ;
+                break;
+        }
+
+        trace_sbull_bio_submit(bio);
+        start = ktime_get_ns();
+        percpu_down_read(&dev->snap_sem);
+        status = dev->zones ? sbull_zone_bio(dev, bio) : __sbull_xfer_bio(dev, bio);
+        percpu_up_read(&dev->snap_sem);
+        ns = ktime_get_ns() - start;
+        trace_sbull_bio_complete(bio, sector, status, ns);
+
+        stats = get_cpu_ptr(dev->stats);
+        stats->ops[op]++;
+        stats->bytes[op] += bytes;
+        stats->lat[op][sbull_lat_bucket(ns)]++;
+        put_cpu_ptr(dev->stats);
+
+        return status;
+}
+
+/*
+ * Latency and bandwidth emulation.  The data is still moved at once, but
+ * completion is held back on an hrtimer until the I/O would have finished
+ * on the device being emulated, so the submitter never waits and
+ * everything above us sees a queue of I/O in flight.  Each I/O takes
+ * completion_nsec plus up to completion_jitter_nsec (uniformly
+ * distributed), after its data has gone through a token bucket that
+ * fills at bandwidth_mbs and holds SBULL_BW_BURST_NS worth of tokens.
+ * The bucket is a virtual clock: the time the link is busy until.
+ *
+ * No I/O is held back for more than half the queue's request timeout, so
+ * blk-mq never times out a request that is only waiting on emulation; an
+ * emulated device slower than that completes at the bound instead.  Bio
+ * queues have no timeout of their own and are bounded by blk-mq's
+ * default one.
+ */
+#define SBULL_BW_BURST_NS       NSEC_PER_MSEC
+#define SBULL_EMUL_TIMEOUT      (30 * HZ)       /* as blk-mq's default rq_timeout */
+
+struct sbull_cmd {
+        struct hrtimer timer;
+        union {
+                struct request *rq;     /* blk-mq: we are its pdu */
+                struct bio *bio;        /* bio: from sbull_cmd_cache */
+        };
+        struct sbull_dev *dev;
+        blk_status_t status;
+        u64 deadline;                   /* polled requests: not done before, in ns */
+};
+
+static struct kmem_cache *sbull_cmd_cache;
+
+/*
+ * When should an I/O moving @bytes of data, submitted now, complete?
+ * 0 if emulation is off.
+ */
+static u64 sbull_emul_deadline(struct sbull_dev *dev, unsigned int bytes)
+{
+        u64 lat = READ_ONCE(completion_nsec);
+        unsigned int jitter = READ_ONCE(completion_jitter_nsec);
+        unsigned int mbs = READ_ONCE(bandwidth_mbs);
+        unsigned int timeout;
+        u64 now, done, bound;
+
+        if (!lat && !jitter && !mbs)
+                return 0;
+
+        now = ktime_get_ns();
+        done = now;
+        if (mbs && bytes) {
+                u64 cost = div_u64((u64)bytes * NSEC_PER_USEC, mbs);   /* 1 MB/s is 1 byte/us */
+                s64 busy = atomic64_read(&dev->bw_clock);
+
+                do {
+                        done = max_t(u64, busy, now - SBULL_BW_BURST_NS) + cost;
+                } while (!atomic64_try_cmpxchg(&dev->bw_clock, &busy, done));
+        }
+        timeout = READ_ONCE(dev->gendisk->queue->rq_timeout) ?: SBULL_EMUL_TIMEOUT;
+        bound = jiffies_to_nsecs(timeout) / 2;
+        lat = min(lat, bound);          /* completion_nsec may be anything */
+        if (jitter)
+                lat += get_random_u32_below(jitter);
+
+        return min(done + lat, now + bound);
+}
+
+static enum hrtimer_restart sbull_cmd_timer(struct hrtimer *timer)
+{
+        struct sbull_cmd *cmd = container_of(timer, struct sbull_cmd, timer);
+        struct sbull_dev *dev = cmd->dev;
+
+        if (queue_mode == SBULL_Q_MQ) {
+                blk_mq_end_request(cmd->rq, cmd->status);
+        } else {
+                struct bio *bio = cmd->bio;
+
+                bio->bi_status = cmd->status;
+                kmem_cache_free(sbull_cmd_cache, cmd);
+                bio_endio(bio);
+                if (atomic_dec_and_test(&dev->emul_pending))
+                        wake_up_var(&dev->emul_pending);
+        }
+        return HRTIMER_NORESTART;
+}
+
+static void sbull_cmd_defer(struct sbull_cmd *cmd, u64 deadline)
+{
+        hrtimer_init(&cmd->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        cmd->timer.function = sbull_cmd_timer;
+        hrtimer_start(&cmd->timer, ns_to_ktime(deadline), HRTIMER_MODE_ABS);
+}
+
+/*
+ * Hold back the completion of @rq if emulation is on.  Returns false if
+ * the caller should complete it now.
+ */
+static bool sbull_defer_request(struct sbull_dev *dev, struct request *rq,
+                                blk_status_t status)
+{
+        struct sbull_cmd *cmd = blk_mq_rq_to_pdu(rq);
+        u64 deadline;
+
+        deadline = sbull_emul_deadline(dev, rq->bio && bio_has_data(rq->bio) ?
+                                       blk_rq_bytes(rq) : 0);
+        if (!deadline)
+                return false;
+
+        cmd->rq = rq;
+        cmd->dev = dev;
+        cmd->status = status;
+        sbull_cmd_defer(cmd, deadline);
+        return true;
+}
+
+static bool sbull_defer_bio(struct sbull_dev *dev, struct bio *bio,
+                            blk_status_t status)
+{
+        struct sbull_cmd *cmd;
+        u64 deadline;
+
+        deadline = sbull_emul_deadline(dev, bio_has_data(bio) ? bio->bi_iter.bi_size : 0);
+        if (!deadline)
+                return false;
+        cmd = kmem_cache_alloc_node(sbull_cmd_cache, GFP_NOIO | __GFP_NOWARN, dev->node);
+        if (!cmd)
+                return false;   /* complete early rather than stall */
+
+        cmd->bio = bio;
+        cmd->dev = dev;
+        cmd->status = status;
+        atomic_inc(&dev->emul_pending);
+        sbull_cmd_defer(cmd, deadline);
+        return true;
+}
+
+/*
+ * With async_io, the submitter only queues its I/O on this CPU's list and
+ * kicks this CPU's worker, which transfers everything queued so far and
+ * completes it as one batch.
+ */
+struct sbull_async {
+        spinlock_t lock;
+        struct bio_list bios;
+        struct list_head rqs;           /* through rq->queuelist */
+        struct work_struct work;
+        struct sbull_dev *dev;
+};
+
+static struct workqueue_struct *sbull_wq;
+
+static void sbull_async_kick(struct sbull_async *a, int cpu)
+{
+        queue_work_on(cpu, sbull_wq, &a->work);
+}
+
+/*
+ * The CPU whose worker takes I/O submitted here: this one if it is on
+ * the device's home node, else one that is.
+ */
+static int sbull_async_cpu(struct sbull_dev *dev)
+{
+        int cpu = raw_smp_processor_id();
+        unsigned int nr;
+
+        if (dev->node == NUMA_NO_NODE || cpu_to_node(cpu) == dev->node)
+                return cpu;
+        nr = cpumask_weight(cpumask_of_node(dev->node));
+        return nr ? cpumask_local_spread(cpu % nr, dev->node) : cpu;
+}
+
+static void sbull_async_add_bio(struct sbull_dev *dev, struct bio *bio)
+{
+        int cpu = sbull_async_cpu(dev);
+        struct sbull_async *a = per_cpu_ptr(dev->async, cpu);
+        unsigned long flags;
+
+        spin_lock_irqsave(&a->lock, flags);
+        bio_list_add(&a->bios, bio);
+        spin_unlock_irqrestore(&a->lock, flags);
+        sbull_async_kick(a, cpu);
+}
+
+static void sbull_async_add_rq(struct sbull_dev *dev, struct request *rq)
+{
+        int cpu = sbull_async_cpu(dev);
+        struct sbull_async *a = per_cpu_ptr(dev->async, cpu);
+        unsigned long flags;
+
+        spin_lock_irqsave(&a->lock, flags);
+        list_add_tail(&rq->queuelist, &a->rqs);
+        spin_unlock_irqrestore(&a->lock, flags);
+        sbull_async_kick(a, cpu);
+}
+
+/*
+ * Complete a transferred bio, now or when emulation says so.
+ */
+static void sbull_end_bio(struct sbull_dev *dev, struct bio *bio,
+                          blk_status_t status)
+{
+        if (sbull_defer_bio(dev, bio, status))
+                return;
+        bio->bi_status = status;
+        bio_endio(bio);
+}
+
+/*
+ * The direct make request version.
+ */
+static void sbull_make_request(struct bio *bio)
+{
+        struct sbull_dev *dev = bio->bi_bdev->bd_disk->queue->queuedata;
+
+        /* Nothing else splits bios at zone boundaries for us. */
+        if (dev->zones) {
+                bio = bio_split_to_limits(bio);
+                if (!bio)
+                        return;
+        }
+        if (async_io) {
+                sbull_async_add_bio(dev, bio);
+                return;
+        }
+        sbull_end_bio(dev, bio, sbull_xfer_bio(dev, bio));
+}
+
+/*
+ * The blk-mq version: a request is just a chain of bios.
+ */
+static blk_status_t sbull_xfer_request(struct sbull_dev *dev,
+                                       struct request *rq)
+{
+        blk_status_t status = BLK_STS_OK;
+        struct bio *bio;
+
+        __rq_for_each_bio(bio, rq) {
+                status = sbull_xfer_bio(dev, bio);
+                if (status != BLK_STS_OK)
+                        break;
+        }
+        /* Where the append went is read back from the request. */
+        if (req_op(rq) == REQ_OP_ZONE_APPEND && status == BLK_STS_OK)
+                rq->__sector = rq->bio->bi_iter.bi_sector;
+
+        return status;
+}
+
+static void sbull_complete_batch(struct io_comp_batch *iob)
+{
+        blk_mq_end_request_batch(iob);
+}
+
+/*
+ * Requests on poll queues (poll_queues) are transferred at once but only
+ * completed from ->poll, by the submitter spinning for them, and not
+ * before their emulated deadline if there is one.
+ */
+struct sbull_pollq {
+        spinlock_t lock;
+        struct list_head list;          /* through rq->queuelist */
+};
+
+static void sbull_poll_add(struct sbull_dev *dev, struct request *rq,
+                           blk_status_t status)
+{
+        struct sbull_pollq *pq = rq->mq_hctx->driver_data;
+        struct sbull_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+        cmd->status = status;
+        cmd->deadline = sbull_emul_deadline(dev, rq->bio && bio_has_data(rq->bio) ?
+                                            blk_rq_bytes(rq) : 0);
+        spin_lock(&pq->lock);
+        list_add_tail(&rq->queuelist, &pq->list);
+        spin_unlock(&pq->lock);
+}
+
+static int sbull_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob)
+{
+        struct sbull_pollq *pq = hctx->driver_data;
+        struct request *rq, *next;
+        LIST_HEAD(list);
+        u64 now = 0;
+        int nr = 0;
+
+        spin_lock(&pq->lock);
+        list_splice_init(&pq->list, &list);
+        spin_unlock(&pq->lock);
+
+        list_for_each_entry_safe(rq, next, &list, queuelist) {
+                struct sbull_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+                if (cmd->deadline) {
+                        if (!now)
+                                now = ktime_get_ns();
+                        if (cmd->deadline > now)
+                                continue;
+                }
+                list_del_init(&rq->queuelist);
+                if (!blk_mq_add_to_batch(rq, iob, cmd->status != BLK_STS_OK,
+                                         sbull_complete_batch))
+                        blk_mq_end_request(rq, cmd->status);
+                nr++;
+        }
+
+        if (!list_empty(&list)) {       /* not due yet, keep them in order */
+                spin_lock(&pq->lock);
+                list_splice(&list, &pq->list);
+                spin_unlock(&pq->lock);
+        }
+        return nr;
+}
+
+/*
+ * Transfer a started request and see it completed: through the poll
+ * list, the emulation timers, @iob if there is one, or right now.
+ */
+static void sbull_handle_request(struct sbull_dev *dev, struct request *rq,
+                                 struct io_comp_batch *iob)
+{
+        blk_status_t status = sbull_xfer_request(dev, rq);
+
+        if (rq->mq_hctx->type == HCTX_TYPE_POLL) {
+                sbull_poll_add(dev, rq, status);
+                return;
+        }
+        if (sbull_defer_request(dev, rq, status))
+                return;
+        if (!iob || !blk_mq_add_to_batch(rq, iob, status != BLK_STS_OK,
+                                         sbull_complete_batch))
+                blk_mq_end_request(rq, status);
+}
+
+static void sbull_dispatch(struct sbull_dev *dev, struct request *rq,
+                           struct io_comp_batch *iob)
+{
+        blk_mq_start_request(rq);
+        if (async_io && rq->mq_hctx->type != HCTX_TYPE_POLL)
+                sbull_async_add_rq(dev, rq);
+        else
+                sbull_handle_request(dev, rq, iob);
+}
+
+static blk_status_t sbull_queue_rq(struct blk_mq_hw_ctx *hctx,
+                                   const struct blk_mq_queue_data *bd)
+{
+        sbull_dispatch(hctx->queue->queuedata, bd->rq, NULL);
+        return BLK_STS_OK;
+}
+
+/*
+ * A whole plug list at once: transfer every request, then complete them
+ * together so the tag and accounting work is done once per batch.
+ */
+static void sbull_queue_rqs(struct request **rqlist)
+{
+        DEFINE_IO_COMP_BATCH(iob);
+        struct request *rq;
+
+        while ((rq = rq_list_pop(rqlist)))
+                sbull_dispatch(rq->q->queuedata, rq, &iob);
+
+        if (iob.complete)
+                iob.complete(&iob);
+}
+
+static void sbull_async_work(struct work_struct *work)
+{
+        struct sbull_async *a = container_of(work, struct sbull_async, work);
+        struct sbull_dev *dev = a->dev;
+        DEFINE_IO_COMP_BATCH(iob);
+        struct request *rq, *next;
+        struct bio_list bios;
+        struct bio *bio;
+        LIST_HEAD(rqs);
+
+        spin_lock_irq(&a->lock);
+        bios = a->bios;
+        bio_list_init(&a->bios);
+        list_splice_init(&a->rqs, &rqs);
+        spin_unlock_irq(&a->lock);
+
+        while ((bio = bio_list_pop(&bios)))
+                sbull_end_bio(dev, bio, sbull_xfer_bio(dev, bio));
+
+        list_for_each_entry_safe(rq, next, &rqs, queuelist) {
+                list_del_init(&rq->queuelist);
+                sbull_handle_request(dev, rq, &iob);
+        }
+        if (iob.complete)
+                iob.complete(&iob);
+}
+
+static void sbull_map_queues(struct blk_mq_tag_set *set)
+{
+        int i, qoff;
+
+        for (i = 0, qoff = 0; i < set->nr_maps; i++) {
+                struct blk_mq_queue_map *map = &set->map[i];
+
+                switch (i) {
+                case HCTX_TYPE_DEFAULT:
+                        map->nr_queues = set->nr_hw_queues - poll_queues;
+                        break;
+                case HCTX_TYPE_POLL:
+                        map->nr_queues = poll_queues;
+                        break;
+                default:
+                        map->nr_queues = 0;
+                        continue;
+                }
+                map->queue_offset = qoff;
+                qoff += map->nr_queues;
+                blk_mq_map_queues(map);
+        }
+}
+
+static int sbull_init_hctx(struct blk_mq_hw_ctx *hctx, void *driver_data,
+                           unsigned int hctx_idx)
+{
+        struct sbull_pollq *pq;
+
+        pq = kzalloc_node(sizeof(*pq), GFP_KERNEL, hctx->numa_node);
+        if (!pq)
+                return -ENOMEM;
+        spin_lock_init(&pq->lock);
+        INIT_LIST_HEAD(&pq->list);
+        hctx->driver_data = pq;
+        return 0;
+}
+
+static void sbull_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+        kfree(hctx->driver_data);
+}
+
+static const struct blk_mq_ops sbull_mq_ops = {
+        .queue_rq = sbull_queue_rq,
+        .queue_rqs = sbull_queue_rqs,
+        .poll = sbull_poll,
+        .map_queues = sbull_map_queues,
+        .init_hctx = sbull_init_hctx,
+        .exit_hctx = sbull_exit_hctx,
+};
+
+/*
+ * Saving the contents to a file at unload and loading them back at the
+ * next load, with image=<path>.  Only populated entries are written,
+ * as runs of consecutive entries: a data run is a segment header
+ * followed by the contents of each entry, a run of entries filled with
+ * the same word is just the header.  The index is cut into parts by
+ * shard and each part is saved and loaded by its own worker, into its
+ * own stretch of the file, through a SBULL_IMAGE_BUF buffer so that the
+ * file sees large sequential I/O.  Pages go through sbull_read_page()
+ * and sbull_write_page(), so an image is independent of compression and
+ * dedup, but not of chunk_order.
+ *
+ * Layout: a header of SBULL_IMAGE_HDR bytes, then the parts.
+ */
+#define SBULL_IMAGE_MAGIC       "SBULLIMG"
+#define SBULL_IMAGE_VERSION     1
+#define SBULL_IMAGE_HDR         4096
+#define SBULL_IMAGE_BUF         (1UL << 20)
+
+struct sbull_image_hdr {
+        char magic[8];
+        __le32 version;
+        __le32 chunk_shift;             /* entry size */
+        __le64 size;                    /* device size in bytes */
+        __le32 nr_parts;
+        __le32 pad;
+        struct {
+                __le64 offset;
+                __le64 len;
+        } parts[SBULL_SHARDS];
+};
+
+enum {
+        SBULL_SEG_DATA = 1,
+        SBULL_SEG_FILL = 2,
+};
+
+struct sbull_image_seg {
+        __le64 idx;                     /* first entry of the run */
+        __le32 nr;                      /* entries in the run */
+        __le16 type;
+        __le16 pad;
+        __le32 fill;                    /* SBULL_SEG_FILL only */
+        __le32 pad2;
+};
+
+struct sbull_image_part {
+        struct work_struct work;
+        struct sbull_dev *dev;
+        struct file *file;
+        unsigned int nr_parts, part;    /* shards part, part + nr_parts, ... */
+        bool dry;                       /* save: only size it up */
+        loff_t pos, end;
+        char *buf;                      /* SBULL_IMAGE_BUF, or a chunk if bigger */
+        size_t bufsize, head, used;
+        int ret;
+};
+
+static int sbull_image_flush(struct sbull_image_part *p)
+{
+        ssize_t n;
+
+        if (!p->dry && p->used) {
+                n = kernel_write(p->file, p->buf, p->used, &p->pos);
+                if (n != p->used)
+                        return n < 0 ? n : -EIO;
+        } else {
+                p->pos += p->used;
+        }
+        p->used = 0;
+        return 0;
+}
+
+/* Room for @len more bytes in the output buffer. */
+static void *sbull_image_reserve(struct sbull_image_part *p, size_t len)
+{
+        void *ptr;
+
+        if (p->used + len > p->bufsize) {
+                p->ret = sbull_image_flush(p);
+                if (p->ret)
+                        return NULL;
+        }
+        ptr = p->buf + p->used;
+        p->used += len;
+        return p->dry ? NULL : ptr;
+}
+
+/* Like sbull_read_page(), but leaves evicted pages where they are. */
+static int sbull_image_read(struct sbull_dev *dev, unsigned long idx,
+                            void *buf, size_t len)
+{
+        bool evicted;
+
+        rcu_read_lock();
+        evicted = sbull_is_evicted(sbull_lookup_entry(dev, idx));
+        rcu_read_unlock();
+
+        if (evicted)
+                return sbull_read_backing(dev, idx, buf);
+        return sbull_read_page(dev, idx, 0, buf, len);
+}
+
+static int sbull_image_save_run(struct sbull_image_part *p, unsigned long idx,
+                                unsigned int nr, void *first)
+{
+        size_t esize = 1UL << p->dev->store.chunk_shift;
+        struct sbull_image_seg *seg;
+        unsigned int i;
+        int ret;
+
+        seg = sbull_image_reserve(p, sizeof(*seg));
+        if (p->ret)
+                return p->ret;
+        if (seg) {
+                memset(seg, 0, sizeof(*seg));
+                seg->idx = cpu_to_le64(idx);
+                seg->nr = cpu_to_le32(nr);
+                seg->type = cpu_to_le16(sbull_entry_has_data(first) ? SBULL_SEG_DATA : SBULL_SEG_FILL);
+                seg->fill = cpu_to_le32(sbull_entry_has_data(first) ? 0 : sbull_entry_fill(first));
+        }
+        if (!sbull_entry_has_data(first))
+                return 0;
+
+        for (i = 0; i < nr; i++) {
+                char *dst = sbull_image_reserve(p, esize);
+
+                if (p->ret)
+                        return p->ret;
+                if (dst) {
+                        ret = sbull_image_read(p->dev, idx + i, dst, esize);
+                        if (ret)
+                                return ret;
+                }
+        }
+        return 0;
+}
+
+/*
+ * The first entry at or after *@key in shard @s of every layer, as the
+ * device sees it: its own layer's if there is one there, else the one
+ * from the nearest frozen layer below.
+ */
+static void *sbull_image_next(struct sbull_dev *dev, unsigned int s,
+                              unsigned long *key)
+{
+        unsigned long next = ULONG_MAX, k;
+        struct sbull_layer *l;
+        void *entry = NULL;
+
+        for (l = dev->top; l; l = l->parent) {
+                k = *key;
+                if (xa_find(&l->shards[s].pages, &k, next, XA_PRESENT))
+                        next = k;
+        }
+        for (l = dev->top; l && !entry; l = l->parent)
+                entry = xa_load(&l->shards[s].pages, next);
+        *key = next;
+        return entry;
+}
+
+/*
+ * Write out (or, dry, just measure) every entry of the part's shards.
+ */
+static int sbull_image_save_part(struct sbull_image_part *p)
+{
+        unsigned int s;
+
+        for (s = p->part; s < SBULL_SHARDS; s += p->nr_parts) {
+                unsigned long key, idx, start = 0;
+                void *entry, *first = NULL;
+                unsigned int nr = 0;
+                int ret;
+
+                for (key = 0; (entry = sbull_image_next(p->dev, s, &key)); key++) {
+                        idx = sbull_shard_idx(s, key);
+                        if (nr && idx == start + nr &&
+                            sbull_entry_has_data(entry) == sbull_entry_has_data(first) &&
+                            (sbull_entry_has_data(entry) || entry == first)) {
+                                nr++;
+                                continue;
+                        }
+                        if (nr) {
+                                ret = sbull_image_save_run(p, start, nr, first);
+                                if (ret)
+                                        return ret;
+                        }
+                        start = idx;
+                        first = entry;
+                        nr = 1;
+                }
+                if (nr) {
+                        ret = sbull_image_save_run(p, start, nr, first);
+                        if (ret)
+                                return ret;
+                }
+        }
+        return sbull_image_flush(p);
+}
+
+/* The next @len bytes of the part, or NULL at its end or on error. */
+static void *sbull_image_need(struct sbull_image_part *p, size_t len)
+{
+        size_t avail = p->used - p->head;
+        ssize_t n;
+        void *ptr;
+
+        if (avail < len) {
+                memmove(p->buf, p->buf + p->head, avail);
+                p->head = 0;
+                p->used = avail;
+                n = min_t(loff_t, p->bufsize - avail, p->end - p->pos);
+                if (n > 0) {
+                        n = kernel_read(p->file, p->buf + avail, n, &p->pos);
+                        if (n < 0) {
+                                p->ret = n;
+                                return NULL;
+                        }
+                        p->used += n;
+                }
+                if (p->used < len) {
+                        if (p->used || p->pos < p->end)
+                                p->ret = -EINVAL;       /* truncated */
+                        return NULL;
+                }
+        }
+        ptr = p->buf + p->head;
+        p->head += len;
+        return ptr;
+}
+
+static int sbull_image_load_part(struct sbull_image_part *p)
+{
+        struct sbull_dev *dev = p->dev;
+        size_t esize = 1UL << dev->store.chunk_shift;
+        struct sbull_image_seg *seg;
+        int ret;
+
+        while ((seg = sbull_image_need(p, sizeof(*seg)))) {
+                unsigned long idx = le64_to_cpu(seg->idx);
+                unsigned int i, nr = le32_to_cpu(seg->nr);
+                unsigned int type = le16_to_cpu(seg->type);
+                u32 fill = le32_to_cpu(seg->fill);
+
+                if (!nr || idx + nr < idx || (idx + nr) > (dev->size >> dev->store.chunk_shift) ||
+                    (type != SBULL_SEG_DATA && type != SBULL_SEG_FILL) ||
+                    (type == SBULL_SEG_FILL && dev->store.chunk_order))
+                        return -EINVAL;
+
+                for (i = 0; i < nr; i++) {
+                        if (type == SBULL_SEG_FILL) {
+                                ret = sbull_store_fill(&dev->store, idx + i, fill, GFP_KERNEL);
+                        } else {
+                                char *src = sbull_image_need(p, esize);
+
+                                if (!src)
+                                        return p->ret ?: -EINVAL;
+                                ret = sbull_write_page(dev, idx + i, 0, src, esize);
+                        }
+                        if (ret)
+                                return ret;
+                }
+                cond_resched();
+        }
+        return p->ret;
+}
+
+static void sbull_image_work(struct work_struct *work)
+{
+        struct sbull_image_part *p = container_of(work, struct sbull_image_part, work);
+
+        p->ret = p->file->f_mode & FMODE_WRITE ? sbull_image_save_part(p) :
+                                                  sbull_image_load_part(p);
+}
+
+/*
+ * Run one worker per part, in parallel, and gather the first error.
+ */
+static int sbull_image_run(struct sbull_image_part *parts, unsigned int nr_parts)
+{
+        unsigned int i;
+        int ret = 0;
+
+        for (i = 0; i < nr_parts; i++) {
+                INIT_WORK(&parts[i].work, sbull_image_work);
+                queue_work_node(parts[i].dev->node, system_unbound_wq, &parts[i].work);
+        }
+        for (i = 0; i < nr_parts; i++) {
+                flush_work(&parts[i].work);
+                if (!ret)
+                        ret = parts[i].ret;
+        }
+        return ret;
+}
+
+static struct sbull_image_part *sbull_image_parts(struct sbull_dev *dev,
+                                                  struct file *file,
+                                                  unsigned int nr_parts)
+{
+        size_t bufsize = max(SBULL_IMAGE_BUF, 2UL << dev->store.chunk_shift);
+        struct sbull_image_part *parts;
+        unsigned int i;
+
+        parts = kcalloc(nr_parts, sizeof(*parts), GFP_KERNEL);
+        if (!parts)
+                return NULL;
+        for (i = 0; i < nr_parts; i++) {
+                parts[i].dev = dev;
+                parts[i].file = file;
+                parts[i].nr_parts = nr_parts;
+                parts[i].part = i;
+                parts[i].bufsize = bufsize;
+                parts[i].buf = kvmalloc(bufsize, GFP_KERNEL);
+                if (!parts[i].buf)
+                        goto fail;
+        }
+        return parts;
+fail:
+        while (i--)
+                kvfree(parts[i].buf);
+        kfree(parts);
+        return NULL;
+}
+
+static void sbull_image_free_parts(struct sbull_image_part *parts,
+                                   unsigned int nr_parts)
+{
+        unsigned int i;
+
+        for (i = 0; i < nr_parts; i++)
+                kvfree(parts[i].buf);
+        kfree(parts);
+}
+
+static int sbull_image_save(struct sbull_dev *dev, const char *path)
+{
+        unsigned int i, nr_parts = min_t(unsigned int, num_online_cpus(), SBULL_SHARDS);
+        struct sbull_image_part *parts;
+        struct sbull_image_hdr *hdr;
+        u64 start = ktime_get_ns();
+        struct file *file;
+        loff_t pos, total;
+        int ret;
+
+        BUILD_BUG_ON(sizeof(*hdr) > SBULL_IMAGE_HDR);
+
+        file = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+        if (IS_ERR(file))
+                return PTR_ERR(file);
+
+        ret = -ENOMEM;
+        hdr = kzalloc(SBULL_IMAGE_HDR, GFP_KERNEL);
+        parts = sbull_image_parts(dev, file, nr_parts);
+        if (!hdr || !parts)
+                goto out;
+
+        /* Size the parts up first so that each can go straight to its place. */
+        pos = SBULL_IMAGE_HDR;
+        for (i = 0; i < nr_parts; i++) {
+                parts[i].dry = true;
+                parts[i].pos = 0;
+        }
+        ret = sbull_image_run(parts, nr_parts);
+        if (ret)
+                goto out;
+
+        memcpy(hdr->magic, SBULL_IMAGE_MAGIC, sizeof(hdr->magic));
+        hdr->version = cpu_to_le32(SBULL_IMAGE_VERSION);
+        hdr->chunk_shift = cpu_to_le32(dev->store.chunk_shift);
+        hdr->size = cpu_to_le64(dev->size);
+        hdr->nr_parts = cpu_to_le32(nr_parts);
+        for (i = 0; i < nr_parts; i++) {
+                loff_t len = parts[i].pos;
+
+                hdr->parts[i].offset = cpu_to_le64(pos);
+                hdr->parts[i].len = cpu_to_le64(len);
+                parts[i].dry = false;
+                parts[i].pos = pos;
+                pos += len;
+        }
+        total = pos;
+
+        ret = sbull_image_run(parts, nr_parts);
+        if (ret)
+                goto out;
+
+        pos = 0;
+        if (kernel_write(file, hdr, SBULL_IMAGE_HDR, &pos) != SBULL_IMAGE_HDR)
+                ret = -EIO;
+        else
+                ret = vfs_fsync(file, 0);
+        if (!ret)
+                pr_info("sbull: saved %lld MiB to %s in %llu ms\n", total >> 20, path,
+                        div_u64(ktime_get_ns() - start, NSEC_PER_MSEC));
+out:
+        if (parts)
+                sbull_image_free_parts(parts, nr_parts);
+        kfree(hdr);
+        filp_close(file, NULL);
+        return ret;
+}
+
+static int sbull_image_load(struct sbull_dev *dev, const char *path)
+{
+        struct sbull_image_part *parts = NULL;
+        struct sbull_image_hdr *hdr;
+        u64 start = ktime_get_ns();
+        unsigned int i, nr_parts;
+        struct file *file;
+        loff_t pos = 0;
+        int ret;
+
+        file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+        if (IS_ERR(file))
+                return PTR_ERR(file);
+
+        ret = -ENOMEM;
+        hdr = kmalloc(SBULL_IMAGE_HDR, GFP_KERNEL);
+        if (!hdr)
+                goto out;
+
+        ret = -EINVAL;
+        nr_parts = 0;
+        if (kernel_read(file, hdr, SBULL_IMAGE_HDR, &pos) != SBULL_IMAGE_HDR ||
+            memcmp(hdr->magic, SBULL_IMAGE_MAGIC, sizeof(hdr->magic)) ||
+            le32_to_cpu(hdr->version) != SBULL_IMAGE_VERSION)
+                goto out;
+        if (le32_to_cpu(hdr->chunk_shift) != dev->store.chunk_shift ||
+            le64_to_cpu(hdr->size) > dev->size) {
+                pr_err("sbull: %s was saved with another size or chunk_order\n", path);
+                goto out;
+        }
+        nr_parts = le32_to_cpu(hdr->nr_parts);
+        if (!nr_parts || nr_parts > SBULL_SHARDS)
+                goto out;
+
+        ret = -ENOMEM;
+        parts = sbull_image_parts(dev, file, nr_parts);
+        if (!parts)
+                goto out;
+        for (i = 0; i < nr_parts; i++) {
+                parts[i].pos = le64_to_cpu(hdr->parts[i].offset);
+                parts[i].end = parts[i].pos + le64_to_cpu(hdr->parts[i].len);
+        }
+
+        ret = sbull_image_run(parts, nr_parts);
+        if (!ret)
+                pr_info("sbull: loaded %s in %llu ms\n", path,
+                        div_u64(ktime_get_ns() - start, NSEC_PER_MSEC));
+out:
+        if (parts)
+                sbull_image_free_parts(parts, nr_parts);
+        kfree(hdr);
+        filp_close(file, NULL);
+        return ret;
+}
+
+/*
+ * Preallocation (populate_mb): give the first populate_mb of the device
+ * zeroed pages (or chunks) at load time, and fills from an image pages
+ * of their own, so that the first pass of a benchmark writes into memory
+ * that is already there and measures the device rather than the page
+ * allocator.  populate_threads workers split the shards between them, so
+ * no two of them ever take the same xa_lock.
+ *
+ * The pages are kernel memory, never swapped out or migrated, so what is
+ * left to pin is our own habit of giving memory back: with populate_pin,
+ * discards zero pages in place and same-filled writes are stored in
+ * full, so a page once there stays there until unload.
+ */
+struct sbull_prealloc {
+        struct work_struct work;
+        struct sbull_dev *dev;
+        unsigned long nr;               /* entries to populate */
+        unsigned int nr_parts, part;    /* shards part, part + nr_parts, ... */
+        int ret;
+};
+
+static int sbull_prealloc_entry(struct sbull_dev *dev, struct xarray *xa,
+                                unsigned long key, void *old)
+{
+        struct page *page;
+        void *cur;
+
+        page = alloc_pages_node(dev->node, GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN |
+                                (dev->store.chunk_order ? __GFP_COMP : 0), dev->store.chunk_order);
+        if (!page)
+                return -ENOMEM;
+        if (old)
+                memset32(page_address(page), sbull_entry_fill(old), PAGE_SIZE / sizeof(u32));
+
+        cur = xa_cmpxchg(xa, key, old, page, GFP_KERNEL);
+        if (cur != old) {
+                __free_pages(page, dev->store.chunk_order);
+                return xa_err(cur);
+        }
+        percpu_counter_inc(&dev->store.nr_pages);
+        if (old)
+                percpu_counter_dec(&dev->store.nr_same);
+        this_cpu_inc(dev->stats->allocs);
+        return 0;
+}
+
+static void sbull_prealloc_work(struct work_struct *work)
+{
+        struct sbull_prealloc *p = container_of(work, struct sbull_prealloc, work);
+        struct sbull_dev *dev = p->dev;
+        unsigned int s;
+
+        for (s = p->part; s < SBULL_SHARDS; s += p->nr_parts) {
+                struct xarray *xa = &dev->top->shards[s].pages;
+                unsigned long key;
+
+                for (key = 0; sbull_shard_idx(s, key) < p->nr; key++) {
+                        void *entry = xa_load(xa, key);
+
+                        if (entry && !xa_is_value(entry))
+                                continue;
+                        p->ret = sbull_prealloc_entry(dev, xa, key, entry);
+                        if (p->ret)
+                                return;
+                        if (!(key & (SBULL_STRIPE_PAGES - 1)))
+                                cond_resched();
+                }
+        }
+}
+
+static int sbull_prealloc(struct sbull_dev *dev, unsigned long bytes)
+{
+        unsigned int i, nr_parts = populate_threads ?: num_online_cpus();
+        struct sbull_prealloc *parts;
+        u64 start = ktime_get_ns();
+        int ret = 0;
+
+        nr_parts = min_t(unsigned int, nr_parts, SBULL_SHARDS);
+        parts = kcalloc(nr_parts, sizeof(*parts), GFP_KERNEL);
+        if (!parts)
+                return -ENOMEM;
+
+        for (i = 0; i < nr_parts; i++) {
+                parts[i].dev = dev;
+                parts[i].nr = DIV_ROUND_UP(min(bytes, dev->size), 1UL << dev->store.chunk_shift);
+                parts[i].nr_parts = nr_parts;
+                parts[i].part = i;
+                INIT_WORK(&parts[i].work, sbull_prealloc_work);
+                queue_work_node(dev->node, system_unbound_wq, &parts[i].work);
+        }
+        for (i = 0; i < nr_parts; i++) {
+                flush_work(&parts[i].work);
+                if (!ret)
+                        ret = parts[i].ret;
+        }
+        kfree(parts);
+
+        if (!ret)
+                pr_info("sbull%d: populated %lu MiB in %llu ms with %u threads\n",
+                        dev->index, min(bytes, dev->size) >> 20,
+                        div_u64(ktime_get_ns() - start, NSEC_PER_MSEC), nr_parts);
+        return ret;
+}
+
+/*
+ * Open and close.
+ */
+/* changed open and release function */
+
+static int sbull_open(struct gendisk *disk, fmode_t mode)
+{
+        struct sbull_dev *dev = disk->private_data;
+
+        spin_lock(&dev->lock);
+        dev->users++;
+        spin_unlock(&dev->lock);
+        
+        return 0;
+}
+
+static void sbull_release(struct gendisk *disk)
+{
+        struct sbull_dev *dev = disk->private_data;
+
+        spin_lock(&dev->lock);
+        dev->users--;
+        spin_unlock(&dev->lock);
+}
+
+/*
+ * Snapshots.  Writing to /sys/kernel/debug/sbullN/snapshot freezes
+ * sbullN's layer, stacks an empty one on it for sbullN to go on writing
+ * into, and adds a new device with an empty layer of its own on the same
+ * frozen one.  Both read through to the frozen layer for pages they have
+ * not written since, and copy such a page into their own layer the first
+ * time they write to it, so a snapshot costs the same whatever the size
+ * of the device.  Writing to .../reset throws away everything a device
+ * wrote since its last snapshot, taking it back to the frozen layer
+ * below; the pages are freed in the background.
+ *
+ * Swapping a device's layer waits out the transfers in progress through
+ * snap_sem, so nothing is still writing into a layer as it is frozen, or
+ * reading one as it is dropped.  Only plain pages can be snapshotted: no
+ * compression, dedup, chunks or backing_file.
+ */
+static DEFINE_MUTEX(sbull_snap_lock);   /* snapshots, resets and sbull_devices[] */
+
+static int setup_device(struct sbull_dev *dev, int which, int node,
+                        struct sbull_dev *origin);
+
+static struct sbull_layer *sbull_layer_alloc(int node)
+{
+        struct sbull_layer *l = kzalloc_node(sizeof(*l), GFP_KERNEL, node);
+
+        if (!l)
+                return NULL;
+        sbull_store_init_shards(l->shards);
+        refcount_set(&l->ref, 1);
+        return l;
+}
+
+/*
+ * Drop a reference to @l, and with the last one free it, its pages and
+ * its reference to the layer below.  Only plain pages and fills can be
+ * left in a layer by then: a device empties its own with
+ * sbull_free_entries() first.
+ */
+static void sbull_layer_put(struct sbull_layer *l)
+{
+        struct sbull_layer *parent;
+        unsigned long key;
+        void *entry;
+        int i;
+
+        for (; l && refcount_dec_and_test(&l->ref); l = parent) {
+                parent = l->parent;
+                for (i = 0; i < SBULL_SHARDS; i++) {
+                        xa_for_each(&l->shards[i].pages, key, entry) {
+                                if (!xa_is_value(entry))
+                                        __free_page(entry);
+                        }
+                        xa_destroy(&l->shards[i].pages);
+                        cond_resched();
+                }
+                kfree(l);
+        }
+}
+
+static void sbull_reap_work(struct work_struct *work)
+{
+        struct sbull_dev *dev = container_of(work, struct sbull_dev, reap_work);
+        struct llist_node *list = llist_del_all(&dev->reap);
+        struct sbull_layer *l, *next;
+
+        llist_for_each_entry_safe(l, next, list, reap)
+                sbull_layer_put(l);
+}
+
+static bool sbull_can_snapshot(struct sbull_dev *dev)
+{
+        return !dev->zpool && !dev->dhash && !dev->store.chunk_order && !dev->backing &&
+               !dev->store.pinned && !dev->zones;
+}
+
+/*
+ * Make the empty layer @top the device's own and return the one it
+ * replaces, with its page count, for the caller to freeze or drop.  The
+ * caller holds sbull_snap_lock and has already set @top->parent.
+ */
+static struct sbull_layer *sbull_swap_top(struct sbull_dev *dev,
+                                          struct sbull_layer *top)
+{
+        struct sbull_layer *old;
+
+        percpu_down_write(&dev->snap_sem);
+        old = dev->top;
+        old->nr_pages = percpu_counter_sum(&dev->store.nr_pages);
+        dev->top = top;
+        dev->store.shards = top->shards;
+        percpu_counter_set(&dev->store.nr_pages, 0);
+        percpu_counter_set(&dev->store.nr_same, 0);
+        percpu_up_write(&dev->snap_sem);
+        return old;
+}
+
+static int sbull_snapshot(struct sbull_dev *dev)
+{
+        struct sbull_layer *top;
+        struct sbull_dev *snap;
+        int which, ret;
+
+        if (!sbull_can_snapshot(dev))
+                return -EOPNOTSUPP;
+
+        mutex_lock(&sbull_snap_lock);
+        /* Past the devices sbull_init() is still setting up, if any. */
+        for (which = nr_devices; which < SBULL_MAX_DEVICES && sbull_devices[which]; which++)
+                ;
+        ret = -ENOSPC;
+        if (which == SBULL_MAX_DEVICES)
+                goto out_unlock;
+
+        ret = -ENOMEM;
+        snap = kzalloc_node(sizeof(*snap), GFP_KERNEL, dev->node);
+        top = sbull_layer_alloc(dev->node);
+        if (!snap || !top) {
+                kfree(top);
+                kfree(snap);
+                goto out_unlock;
+        }
+
+        top->parent = dev->top;         /* takes over the device's reference */
+        sbull_swap_top(dev, top);
+        ret = setup_device(snap, which, dev->node, dev);
+        if (ret) {
+                kfree(snap);
+                goto out_unlock;
+        }
+        sbull_devices[which] = snap;
+        pr_info("sbull: sbull%d is a snapshot of sbull%d\n", which, dev->index);
+
+out_unlock:
+        mutex_unlock(&sbull_snap_lock);
+        return ret;
+}
+
+static int sbull_reset(struct sbull_dev *dev)
+{
+        struct sbull_layer *top;
+        int ret = 0;
+
+        mutex_lock(&sbull_snap_lock);
+        if (!dev->top->parent) {
+                ret = -EINVAL;          /* no snapshot to go back to */
+                goto out_unlock;
+        }
+        top = sbull_layer_alloc(dev->node);
+        if (!top) {
+                ret = -ENOMEM;
+                goto out_unlock;
+        }
+
+        top->parent = dev->top->parent;
+        refcount_inc(&top->parent->ref);
+        llist_add(&sbull_swap_top(dev, top)->reap, &dev->reap);
+        queue_work_node(dev->node, system_unbound_wq, &dev->reap_work);
+
+out_unlock:
+        mutex_unlock(&sbull_snap_lock);
+        return ret;
+}
+
+static ssize_t snapshot_write(struct file *file, const char __user *buf,
+                              size_t count, loff_t *ppos)
+{
+        int ret = sbull_snapshot(file->private_data);
+
+        return ret ? ret : count;
+}
+
+static const struct file_operations snapshot_fops = {
+        .owner = THIS_MODULE,
+        .open = simple_open,
+        .write = snapshot_write,
+        .llseek = noop_llseek,
+};
+
+static ssize_t reset_write(struct file *file, const char __user *buf,
+                           size_t count, loff_t *ppos)
+{
+        int ret = sbull_reset(file->private_data);
+
+        return ret ? ret : count;
+}
+
+static const struct file_operations reset_fops = {
+        .owner = THIS_MODULE,
+        .open = simple_open,
+        .write = reset_write,
+        .llseek = noop_llseek,
+};
+
+/*
+ * Memory accounting, exported as /sys/block/sbullN/{pages_used,mem_used}.
+ * same_pages counts pages elided as same-filled, each saving PAGE_SIZE.
+ */
+static ssize_t pages_used_show(struct device *d, struct device_attribute *attr,
+                               char *buf)
+{
+        struct sbull_dev *dev = dev_to_disk(d)->private_data;
+
+        return sysfs_emit(buf, "%lld\n",
+                          percpu_counter_sum(&dev->store.nr_pages) << dev->store.chunk_order);
+}
+static DEVICE_ATTR_RO(pages_used);
+
+static ssize_t same_pages_show(struct device *d, struct device_attribute *attr,
+                               char *buf)
+{
+        struct sbull_dev *dev = dev_to_disk(d)->private_data;
+
+        return sysfs_emit(buf, "%lld\n", percpu_counter_sum(&dev->store.nr_same));
+}
+static DEVICE_ATTR_RO(same_pages);
+
+static ssize_t mem_used_show(struct device *d, struct device_attribute *attr,
+                             char *buf)
+{
+        struct sbull_dev *dev = dev_to_disk(d)->private_data;
+
+        if (dev->zpool)
+                return sysfs_emit(buf, "%lu\n",
+                                  zs_get_total_pages(dev->zpool) << PAGE_SHIFT);
+        if (dev->dhash)
+                return sysfs_emit(buf, "%lld\n",
+                                  percpu_counter_sum(&dev->nr_unique) << PAGE_SHIFT);
+        return sysfs_emit(buf, "%lld\n",
+                          percpu_counter_sum(&dev->store.nr_pages) << dev->store.chunk_shift);
+}
+static DEVICE_ATTR_RO(mem_used);
+
+/*
+ * comp_stat, for comp_algorithm only:
+ *   orig_data_size compr_data_size ratio comp_ops comp_ns decomp_ops decomp_ns
+ * ratio is orig/compr with two decimals; *_ns are totals over *_ops.
+ */
+static ssize_t comp_stat_show(struct device *d, struct device_attribute *attr,
+                              char *buf)
+{
+        struct sbull_dev *dev = dev_to_disk(d)->private_data;
+        u64 comp_ops = 0, comp_ns = 0, decomp_ops = 0, decomp_ns = 0;
+        u64 orig, compr, ratio;
+        int cpu;
+
+        for_each_possible_cpu(cpu) {
+                struct sbull_zstrm *zstrm = per_cpu_ptr(dev->zstrm, cpu);
+
+                comp_ops += zstrm->comp_ops;
+                comp_ns += zstrm->comp_ns;
+                decomp_ops += zstrm->decomp_ops;
+                decomp_ns += zstrm->decomp_ns;
+        }
+
+        orig = percpu_counter_sum(&dev->store.nr_pages) << PAGE_SHIFT;
+        compr = percpu_counter_sum(&dev->compr_bytes);
+        ratio = compr ? div64_u64(orig * 100, compr) : 0;
+
+        return sysfs_emit(buf, "%llu %llu %llu.%02llu %llu %llu %llu %llu\n",
+                          orig, compr, ratio / 100, ratio % 100,
+                          comp_ops, comp_ns, decomp_ops, decomp_ns);
+}
+static DEVICE_ATTR_RO(comp_stat);
+
+/*
+ * dedup_stat, for dedup only:
+ *   unique_pages hits saved_bytes
+ * saved_bytes is what pages_used would cost without sharing, minus what
+ * the unique pages do.
+ */
+static ssize_t dedup_stat_show(struct device *d, struct device_attribute *attr,
+                               char *buf)
+{
+        struct sbull_dev *dev = dev_to_disk(d)->private_data;
+        s64 pages = percpu_counter_sum(&dev->store.nr_pages);
+        s64 unique = percpu_counter_sum(&dev->nr_unique);
+
+        return sysfs_emit(buf, "%lld %lld %lld\n", unique,
+                          percpu_counter_sum(&dev->dedup_hits),
+                          (pages - unique) << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(dedup_stat);
+
+/*
+ * snap_stat, for devices that can be snapshotted:
+ *   private_pages shared_pages layers
+ * Private pages were written since the device's last snapshot or reset
+ * and are its own (pages_used); shared ones are held by the frozen
+ * layers under it, for it and its snapshots to read.
+ */
+static ssize_t snap_stat_show(struct device *d, struct device_attribute *attr,
+                              char *buf)
+{
+        struct sbull_dev *dev = dev_to_disk(d)->private_data;
+        struct sbull_layer *l;
+        unsigned int layers = 0;
+        s64 shared = 0;
+
+        mutex_lock(&sbull_snap_lock);
+        for (l = dev->top->parent; l; l = l->parent) {
+                shared += l->nr_pages;
+                layers++;
+        }
+        mutex_unlock(&sbull_snap_lock);
+
+        return sysfs_emit(buf, "%lld %lld %u\n", percpu_counter_sum(&dev->store.nr_pages),
+                          shared, layers);
+}
+static DEVICE_ATTR_RO(snap_stat);
+
+static struct attribute *sbull_attrs[] = {
+        &dev_attr_pages_used.attr,
+        &dev_attr_same_pages.attr,
+        &dev_attr_mem_used.attr,
+        &dev_attr_comp_stat.attr,
+        &dev_attr_dedup_stat.attr,
+        &dev_attr_snap_stat.attr,
+        NULL,
+};
+
+static umode_t sbull_attr_visible(struct kobject *kobj, struct attribute *attr,
+                                  int n)
+{
+        struct sbull_dev *dev = dev_to_disk(kobj_to_dev(kobj))->private_data;
+
+        if (attr == &dev_attr_comp_stat.attr && !dev->zpool)
+                return 0;
+        if (attr == &dev_attr_dedup_stat.attr && !dev->dhash)
+                return 0;
+        if (attr == &dev_attr_snap_stat.attr && !sbull_can_snapshot(dev))
+                return 0;
+        return attr->mode;
+}
+
+static const struct attribute_group sbull_attr_group = {
+        .attrs = sbull_attrs,
+        .is_visible = sbull_attr_visible,
+};
+
+static const struct attribute_group *sbull_attr_groups[] = {
+        &sbull_attr_group,
+        NULL,
+};
+
+/*
+ * I/O statistics, in /sys/kernel/debug/sbullN/: "stats" has the totals,
+ * "latency" a log2 histogram of service time per op type, one row per
+ * bucket starting at its lower bound in ns.
+ */
+static const char * const sbull_stat_names[SBULL_NR_STATS] = {
+        [SBULL_STAT_READ] = "read",
+        [SBULL_STAT_WRITE] = "write",
+        [SBULL_STAT_DISCARD] = "discard",
+};
+
+static void sbull_sum_stats(struct sbull_dev *dev, struct sbull_stats *sum)
+{
+        int cpu, op, b;
+
+        memset(sum, 0, sizeof(*sum));
+        for_each_possible_cpu(cpu) {
+                struct sbull_stats *s = per_cpu_ptr(dev->stats, cpu);
+
+                for (op = 0; op < SBULL_NR_STATS; op++) {
+                        sum->ops[op] += s->ops[op];
+                        sum->bytes[op] += s->bytes[op];
+                        for (b = 0; b < SBULL_LAT_BUCKETS; b++)
+                                sum->lat[op][b] += s->lat[op][b];
+                }
+                sum->allocs += s->allocs;
+                sum->cache_allocs += s->cache_allocs;
+                sum->lookups += s->lookups;
+                sum->lookup_levels += s->lookup_levels;
+                sum->evictions += s->evictions;
+                sum->writebacks += s->writebacks;
+                sum->faults += s->faults;
+                sum->copyups += s->copyups;
+                sum->copy_ios += s->copy_ios;
+                sum->copy_bytes += s->copy_bytes;
+                sum->nt_ios += s->nt_ios;
+                sum->nt_bytes += s->nt_bytes;
+        }
+}
+
+static int stats_show(struct seq_file *m, void *v)
+{
+        struct sbull_dev *dev = m->private;
+        struct sbull_stats *sum;
+        int op;
+
+        sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+        if (!sum)
+                return -ENOMEM;
+        sbull_sum_stats(dev, sum);
+
+        for (op = 0; op < SBULL_NR_STATS; op++) {
+                seq_printf(m, "%s_ops %llu\n", sbull_stat_names[op], sum->ops[op]);
+                seq_printf(m, "%s_bytes %llu\n", sbull_stat_names[op], sum->bytes[op]);
+        }
+        seq_printf(m, "allocs %llu\n", sum->allocs);
+        seq_printf(m, "cache_allocs %llu\n", sum->cache_allocs);
+        if (dev->page_pool)
+                seq_printf(m, "reserve_pages %d\n", READ_ONCE(dev->page_pool->curr_nr));
+        seq_printf(m, "lookups %llu\n", sum->lookups);
+        seq_printf(m, "lookup_levels %llu\n", sum->lookup_levels);
+        seq_printf(m, "copyups %llu\n", sum->copyups);
+        seq_printf(m, "copy_ios %llu\n", sum->copy_ios);
+        seq_printf(m, "copy_bytes %llu\n", sum->copy_bytes);
+        seq_printf(m, "nt_ios %llu\n", sum->nt_ios);
+        seq_printf(m, "nt_bytes %llu\n", sum->nt_bytes);
+        if (dev->backing) {
+                seq_printf(m, "evicted_pages %lld\n", percpu_counter_sum(&dev->nr_evicted));
+                seq_printf(m, "evictions %llu\n", sum->evictions);
+                seq_printf(m, "writebacks %llu\n", sum->writebacks);
+                seq_printf(m, "faults %llu\n", sum->faults);
+        }
+
+        kfree(sum);
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static int latency_show(struct seq_file *m, void *v)
+{
+        struct sbull_dev *dev = m->private;
+        struct sbull_stats *sum;
+        int op, b;
+
+        sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+        if (!sum)
+                return -ENOMEM;
+        sbull_sum_stats(dev, sum);
+
+        seq_puts(m, "# ns");
+        for (op = 0; op < SBULL_NR_STATS; op++)
+                seq_printf(m, " %s", sbull_stat_names[op]);
+        seq_putc(m, '\n');
+        for (b = 0; b < SBULL_LAT_BUCKETS; b++) {
+                seq_printf(m, "%llu", b ? 1ULL << b : 0ULL);
+                for (op = 0; op < SBULL_NR_STATS; op++)
+                        seq_printf(m, " %llu", sum->lat[op][b]);
+                seq_putc(m, '\n');
+        }
+
+        kfree(sum);
+        return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static void sbull_debugfs_init(struct sbull_dev *dev)
+{
+        dev->debugfs = debugfs_create_dir(dev->gendisk->disk_name, NULL);
+        debugfs_create_file("stats", 0444, dev->debugfs, dev, &stats_fops);
+        debugfs_create_file("latency", 0444, dev->debugfs, dev, &latency_fops);
+        if (sbull_can_snapshot(dev)) {
+                debugfs_create_file("snapshot", 0200, dev->debugfs, dev, &snapshot_fops);
+                debugfs_create_file("reset", 0200, dev->debugfs, dev, &reset_fops);
+        }
+}
+
+/*
+ * The device operations structure.
+ */
+static struct block_device_operations sbull_ops = {
+        .open = sbull_open,
+        .release = sbull_release,
+        .submit_bio = sbull_make_request,
+        .report_zones = sbull_report_zones,
+};
+
+static struct block_device_operations sbull_rq_ops = {
+        .open = sbull_open,
+        .release = sbull_release,
+        .report_zones = sbull_report_zones,
+};
+
+/*
+ * One hardware queue per CPU unless submit_queues says otherwise.  The
+ * transfer path may sleep allocating pages, hence BLK_MQ_F_BLOCKING.
+ */
+static int sbull_init_tag_set(struct sbull_dev *dev)
+{
+        struct blk_mq_tag_set *set = &dev->tag_set;
+
+        set->ops = &sbull_mq_ops;
+        set->nr_hw_queues = (submit_queues > 0 ? submit_queues : nr_cpu_ids) + poll_queues;
+        set->nr_maps = poll_queues ? HCTX_MAX_TYPES : 1;
+        set->queue_depth = hw_queue_depth;
+        set->numa_node = dev->node;
+        set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+        set->cmd_size = sizeof(struct sbull_cmd);
+        set->driver_data = dev;
+
+        return blk_mq_alloc_tag_set(set);
+}
+
+static int sbull_init_async(struct sbull_dev *dev)
+{
+        int cpu;
+
+        dev->async = alloc_percpu(struct sbull_async);
+        if (!dev->async)
+                return -ENOMEM;
+
+        for_each_possible_cpu(cpu) {
+                struct sbull_async *a = per_cpu_ptr(dev->async, cpu);
+
+                spin_lock_init(&a->lock);
+                bio_list_init(&a->bios);
+                INIT_LIST_HEAD(&a->rqs);
+                INIT_WORK(&a->work, sbull_async_work);
+                a->dev = dev;
+        }
+        return 0;
+}
+
+/*
+ * Page caches and reserve for plain pages.  The caches of the CPUs that
+ * are up start filling at once; the rest fill on first use.
+ */
+static int sbull_init_alloc(struct sbull_dev *dev)
+{
+        int cpu;
+
+        INIT_WORK(&dev->pool_work, sbull_pool_refill);
+        if (page_reserve) {
+                dev->page_pool = mempool_create_node(page_reserve, sbull_pool_alloc,
+                                                     sbull_pool_free, dev, GFP_KERNEL,
+                                                     dev->node);
+                if (!dev->page_pool)
+                        return -ENOMEM;
+        }
+        if (!pcp_pages)
+                return 0;
+
+        dev->pcp = alloc_percpu(struct sbull_pcp);
+        if (!dev->pcp) {
+                mempool_destroy(dev->page_pool);
+                dev->page_pool = NULL;
+                return -ENOMEM;
+        }
+        for_each_possible_cpu(cpu) {
+                struct sbull_pcp *pcp = per_cpu_ptr(dev->pcp, cpu);
+
+                local_lock_init(&pcp->lock);
+                INIT_WORK(&pcp->refill, sbull_pcp_refill);
+                pcp->dev = dev;
+        }
+        for_each_online_cpu(cpu)
+                queue_work_on(cpu, sbull_alloc_wq, &per_cpu_ptr(dev->pcp, cpu)->refill);
+        return 0;
+}
+
+static void sbull_exit_alloc(struct sbull_dev *dev)
+{
+        int cpu;
+
+        if (dev->pcp) {
+                for_each_possible_cpu(cpu) {
+                        struct sbull_pcp *pcp = per_cpu_ptr(dev->pcp, cpu);
+
+                        cancel_work_sync(&pcp->refill);
+                        while (pcp->nr)
+                                __free_page(pcp->pages[--pcp->nr]);
+                }
+                free_percpu(dev->pcp);
+                dev->pcp = NULL;
+        }
+        if (dev->page_pool) {
+                cancel_work_sync(&dev->pool_work);
+                mempool_destroy(dev->page_pool);
+                dev->page_pool = NULL;
+        }
+}
+
+static void sbull_exit_async(struct sbull_dev *dev)
+{
+        int cpu;
+
+        if (!dev->async)
+                return;
+        for_each_possible_cpu(cpu)
+                flush_work(&per_cpu_ptr(dev->async, cpu)->work);
+        free_percpu(dev->async);
+        dev->async = NULL;
+}
+
+static void sbull_exit_backing(struct sbull_dev *dev)
+{
+        if (dev->backing) {
+                cancel_work_sync(&dev->evict_work);
+                filp_close(dev->backing, NULL);
+                dev->backing = NULL;
+                dev->store.evictable = false;
+        }
+        kvfree(dev->store.ref);
+        kvfree(dev->store.dirty);
+        dev->store.ref = dev->store.dirty = NULL;
+        percpu_counter_destroy(&dev->nr_evicted);
+}
+
+/*
+ * The backing file holds page N at offset N * PAGE_SIZE, so size it to
+ * the device up front and let the filesystem keep it sparse.
+ */
+static int sbull_init_backing(struct sbull_dev *dev, const char *path)
+{
+        size_t bytes = BITS_TO_LONGS(dev->size >> PAGE_SHIFT) * sizeof(long);
+        struct file *file;
+        int ret;
+
+        INIT_WORK(&dev->evict_work, sbull_evict_work);
+
+        ret = percpu_counter_init(&dev->nr_evicted, 0, GFP_KERNEL);
+        if (ret)
+                return ret;
+        dev->store.ref = kvzalloc_node(bytes, GFP_KERNEL, dev->node);
+        dev->store.dirty = kvzalloc_node(bytes, GFP_KERNEL, dev->node);
+        if (!dev->store.ref || !dev->store.dirty) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+        if (IS_ERR(file)) {
+                ret = PTR_ERR(file);
+                goto out;
+        }
+        ret = vfs_truncate(&file->f_path, dev->size);
+        if (ret) {
+                filp_close(file, NULL);
+                goto out;
+        }
+
+        dev->mem_limit = mem_limit_mb << (20 - PAGE_SHIFT);
+        dev->backing = file;
+        dev->store.evictable = true;
+        return 0;
+
+out:
+        pr_err("sbull: can't use %s as backing file: %d\n", path, ret);
+        sbull_exit_backing(dev);
+        return ret;
+}
+
+static void sbull_exit_comp(struct sbull_dev *dev)
+{
+        int cpu;
+
+        if (dev->zpool) {
+                flush_work(&dev->zfree_work);
+                zs_destroy_pool(dev->zpool);
+        }
+        percpu_counter_destroy(&dev->compr_bytes);
+
+        if (!dev->zstrm)
+                return;
+        for_each_possible_cpu(cpu) {
+                struct sbull_zstrm *zstrm = per_cpu_ptr(dev->zstrm, cpu);
+
+                if (!IS_ERR_OR_NULL(zstrm->tfm))
+                        crypto_free_comp(zstrm->tfm);
+                vfree(zstrm->buffer);
+        }
+        free_percpu(dev->zstrm);
+}
+
+/*
+ * One compression stream per possible CPU, so compressing never has to
+ * wait for another CPU.
+ */
+static int sbull_init_comp(struct sbull_dev *dev)
+{
+        char name[DISK_NAME_LEN];
+        int cpu, ret;
+
+        if (!crypto_has_comp(comp_algorithm, 0, 0)) {
+                pr_err("sbull: unknown compression algorithm %s\n", comp_algorithm);
+                return -ENOENT;
+        }
+
+        init_llist_head(&dev->zfree);
+        INIT_WORK(&dev->zfree_work, sbull_zfree_work);
+
+        dev->zstrm = alloc_percpu(struct sbull_zstrm);
+        if (!dev->zstrm)
+                return -ENOMEM;
+
+        for_each_possible_cpu(cpu) {
+                struct sbull_zstrm *zstrm = per_cpu_ptr(dev->zstrm, cpu);
+
+                local_lock_init(&zstrm->lock);
+                zstrm->tfm = crypto_alloc_comp(comp_algorithm, 0, 0);
+                if (IS_ERR(zstrm->tfm)) {
+                        ret = PTR_ERR(zstrm->tfm);
+                        goto out;
+                }
+                zstrm->buffer = vzalloc(2 * PAGE_SIZE);
+                if (!zstrm->buffer) {
+                        ret = -ENOMEM;
+                        goto out;
+                }
+        }
+
+        ret = percpu_counter_init(&dev->compr_bytes, 0, GFP_KERNEL);
+        if (ret)
+                goto out;
+
+        snprintf(name, sizeof(name), "sbull%d", dev->index);
+        dev->zpool = zs_create_pool(name);
+        if (!dev->zpool) {
+                ret = -ENOMEM;
+                goto out;
+        }
+        return 0;
+
+out:
+        sbull_exit_comp(dev);
+        dev->zstrm = NULL;
+        return ret;
+}
+
+static void sbull_exit_dedup(struct sbull_dev *dev)
+{
+        kvfree(dev->dhash);
+        percpu_counter_destroy(&dev->dedup_hits);
+        percpu_counter_destroy(&dev->nr_unique);
+}
+
+/*
+ * About one hash bucket per four pages of capacity.
+ */
+static int sbull_init_dedup(struct sbull_dev *dev)
+{
+        unsigned long i, nr = roundup_pow_of_two(max(dev->size >> (PAGE_SHIFT + 2), 1024UL));
+        int ret;
+
+        ret = percpu_counter_init(&dev->nr_unique, 0, GFP_KERNEL);
+        if (!ret)
+                ret = percpu_counter_init(&dev->dedup_hits, 0, GFP_KERNEL);
+        if (ret)
+                goto out;
+
+        dev->dhash = kvmalloc_node(array_size(nr, sizeof(*dev->dhash)), GFP_KERNEL, dev->node);
+        if (!dev->dhash) {
+                ret = -ENOMEM;
+                goto out;
+        }
+        for (i = 0; i < nr; i++) {
+                spin_lock_init(&dev->dhash[i].lock);
+                INIT_HLIST_HEAD(&dev->dhash[i].head);
+        }
+        dev->dhash_mask = nr - 1;
+        return 0;
+
+out:
+        sbull_exit_dedup(dev);
+        return ret;
+}
+
+/*
+ * Set up our internal device.
+ */
+/*
+ * Set up sbull<which>, or with @origin, a snapshot of it on the layer
+ * sbull_snapshot() has just frozen.
+ */
+static noinline int setup_device(struct sbull_dev *dev, int which, int node,
+                                 struct sbull_dev *origin)
+{
+        int ret;
+
+        dev->index = which;
+        dev->node = node;
+        if (origin)
+                dev->size = origin->size;
+        else if (which < nr_capacity && capacity_mb[which])
+                dev->size = capacity_mb[which] << 20;
+        else
+                dev->size = (unsigned long)nsectors * hardsect_size;
+        if (!origin && which < nr_image && image[which] && *image[which])
+                dev->image = image[which];
+        spin_lock_init(&dev->lock);     /* Initialize spinlock */
+        
+        dev->top = sbull_layer_alloc(node);
+        if (!dev->top)
+                return -ENOMEM;
+        if (origin) {
+                dev->top->parent = origin->top->parent;
+                refcount_inc(&dev->top->parent->ref);
+        }
+        init_llist_head(&dev->reap);
+        INIT_WORK(&dev->reap_work, sbull_reap_work);
+        ret = percpu_init_rwsem(&dev->snap_sem);
+        if (ret)
+                goto out_layer;
+
+        ret = sbull_store_init(&dev->store, dev->top->shards, dev->size, node);
+        if (ret) {
+                pr_err("Failed to allocate page counter: %d\n", ret);
+                goto out_rwsem;
+        }
+        dev->store.ops = &sbull_dev_store_ops;
+        dev->store.chunk_order = chunk_order;
+        dev->store.chunk_shift = PAGE_SHIFT + chunk_order;
+        dev->store.pinned = populate_pin && !origin;
+        dev->stats = alloc_percpu(struct sbull_stats);
+        if (!dev->stats) {
+                ret = -ENOMEM;
+                goto out_counter;
+        }
+        if (async_io) {
+                ret = sbull_init_async(dev);
+                if (ret)
+                        goto out_counter;
+        }
+        if (sbull_alloc_wq) {
+                ret = sbull_init_alloc(dev);
+                if (ret)
+                        goto out_counter;
+        }
+        if (zoned) {
+                ret = sbull_init_zones(dev);
+                if (ret)
+                        goto out_counter;
+        }
+        if (!origin && which < nr_backing_file && backing_file[which] && *backing_file[which]) {
+                ret = sbull_init_backing(dev, backing_file[which]);
+                if (ret)
+                        goto out_counter;
+        }
+
+        if (comp_algorithm && *comp_algorithm) {
+                ret = sbull_init_comp(dev);
+                if (ret)
+                        goto out_counter;
+        } else if (dedup) {
+                ret = sbull_init_dedup(dev);
+                if (ret)
+                        goto out_counter;
+        }
+        
+        /* gendisk structure */
+        if (queue_mode == SBULL_Q_MQ) {
+                ret = sbull_init_tag_set(dev);
+                if (ret) {
+                        pr_err("Failed to allocate tag set: %d\n", ret);
+                        goto out_comp;
+                }
+                dev->gendisk = blk_mq_alloc_disk(&dev->tag_set, dev);
+                if (IS_ERR(dev->gendisk)) {
+                        pr_info("alloc_disk failure\n");
+                        ret = PTR_ERR(dev->gendisk);
+                        goto out_tag_set;
+                }
+        } else {
+                dev->gendisk = blk_alloc_disk(dev->node);
+                if (!dev->gendisk) {
+                        pr_info("alloc_disk failure\n");
+                        ret = -ENOMEM;
+                        goto out_comp;
+                }
+        }
+
+        dev->gendisk->queue->queuedata = dev;
+
+        /*
+         * And the gendisk structure.
+         */
+        dev->gendisk->major = sbull_major;
+        dev->gendisk->first_minor = dev->index;
+        dev->gendisk->minors = 1;
+        dev->gendisk->fops = queue_mode == SBULL_Q_MQ ? &sbull_rq_ops : &sbull_ops;
+        dev->gendisk->private_data = dev;       /* register the private data structure */
+
+        snprintf(dev->gendisk->disk_name, 32, "sbull%d", dev->index);
+
+        /*
+         * To ensure that we always get PAGE_SIZE aligned
+         * and n*PAGE_SIZED sized I/O requests.
+         */
+        blk_queue_physical_block_size(dev->gendisk->queue, PAGE_SIZE);
+        blk_queue_logical_block_size(dev->gendisk->queue, 1 << 12);
+        blk_queue_io_min(dev->gendisk->queue, PAGE_SIZE);
+
+        /*
+         * Big I/O is cheap for us (one index walk per SBULL_BATCH entries),
+         * so take requests of up to SBULL_MAX_IO_BYTES, or a whole chunk
+         * if that is bigger, but never one spanning two chunks.
+         */
+        blk_queue_max_hw_sectors(dev->gendisk->queue,
+                                 max(SBULL_MAX_IO_BYTES, 1UL << dev->store.chunk_shift) >> SECTOR_SHIFT);
+        blk_queue_max_segments(dev->gendisk->queue, SBULL_MAX_IO_BYTES >> PAGE_SHIFT);
+        if (dev->store.chunk_order)
+                blk_queue_chunk_sectors(dev->gendisk->queue, 1U << (dev->store.chunk_shift - SECTOR_SHIFT));
+
+        /* Discarded and zeroed pages are given back to the allocator. */
+        dev->gendisk->queue->limits.discard_granularity = PAGE_SIZE;
+        blk_queue_max_discard_sectors(dev->gendisk->queue, UINT_MAX >> SECTOR_SHIFT);
+        blk_queue_max_write_zeroes_sectors(dev->gendisk->queue, UINT_MAX >> SECTOR_SHIFT);
+
+        set_capacity(dev->gendisk, dev->size >> SECTOR_SHIFT);
+
+        /* A zone reset is how a zoned device gives pages back. */
+        if (dev->zones) {
+                struct request_queue *q = dev->gendisk->queue;
+
+                disk_set_zoned(dev->gendisk, BLK_ZONED_HM);
+                blk_queue_flag_set(QUEUE_FLAG_ZONE_RESETALL, q);
+                blk_queue_chunk_sectors(q, 1U << dev->zone_shift);
+                blk_queue_max_zone_append_sectors(q, queue_max_hw_sectors(q));
+                disk_set_max_open_zones(dev->gendisk, zone_max_open);
+                disk_set_max_active_zones(dev->gendisk, zone_max_active);
+                blk_queue_max_discard_sectors(q, 0);
+                blk_queue_max_write_zeroes_sectors(q, 0);
+                if (queue_mode == SBULL_Q_MQ)
+                        blk_queue_required_elevator_features(q, ELEVATOR_F_ZBD_SEQ_WRITE);
+                ret = blk_revalidate_disk_zones(dev->gendisk, NULL);
+                if (ret) {
+                        pr_err("sbull: can't set up zones for sbull%d: %d\n", which, ret);
+                        goto out_disk;
+                }
+        }
+
+        /* Nobody can see the disk yet, so the image loads undisturbed. */
+        if (dev->image) {
+                ret = sbull_image_load(dev, dev->image);
+                if (ret && ret != -ENOENT) {
+                        pr_warn("sbull: can't load %s (%d), starting empty\n", dev->image, ret);
+                        sbull_free_entries(dev);
+                }
+        }
+        if (!origin && which < nr_populate_mb && populate_mb[which]) {
+                ret = sbull_prealloc(dev, populate_mb[which] << 20);
+                if (ret) {
+                        pr_err("sbull: can't populate sbull%d: %d\n", which, ret);
+                        goto out_disk;
+                }
+        }
+
+        ret = device_add_disk(NULL, dev->gendisk, sbull_attr_groups);
+        if (ret != 0) {
+                pr_err("Failed to add sbull device: %d\n", ret);
+                goto out_disk;
+        }
+        sbull_debugfs_init(dev);
+
+        return 0;
+
+ out_disk:
+        sbull_free_entries(dev);
+        put_disk(dev->gendisk);
+ out_tag_set:
+        if (queue_mode == SBULL_Q_MQ)
+                blk_mq_free_tag_set(&dev->tag_set);
+ out_comp:
+        sbull_exit_comp(dev);
+        sbull_exit_dedup(dev);
+ out_counter:
+        kvfree(dev->zones);
+        sbull_exit_backing(dev);
+        sbull_exit_alloc(dev);
+        sbull_exit_async(dev);
+        free_percpu(dev->stats);
+        sbull_store_destroy(&dev->store);
+ out_rwsem:
+        percpu_free_rwsem(&dev->snap_sem);
+ out_layer:
+        sbull_layer_put(dev->top);
+        return ret;
+}
+
+static void teardown_device(struct sbull_dev *dev)
+{
+        debugfs_remove_recursive(dev->debugfs);
+        del_gendisk(dev->gendisk);
+        sbull_exit_async(dev);
+        /* blk-mq drains held-back requests in del_gendisk, bios we wait for */
+        wait_var_event(&dev->emul_pending, !atomic_read(&dev->emul_pending));
+        if (dev->backing)
+                cancel_work_sync(&dev->evict_work);
+        put_disk(dev->gendisk);
+        if (queue_mode == SBULL_Q_MQ)
+                blk_mq_free_tag_set(&dev->tag_set);
+        if (dev->image) {
+                int ret = sbull_image_save(dev, dev->image);
+
+                if (ret)
+                        pr_err("sbull: can't save to %s: %d\n", dev->image, ret);
+        }
+        sbull_free_entries(dev);
+        flush_work(&dev->reap_work);
+        sbull_layer_put(dev->top);
+        kvfree(dev->zones);
+        sbull_exit_backing(dev);
+        sbull_exit_alloc(dev);
+        sbull_exit_comp(dev);
+        sbull_exit_dedup(dev);
+        free_percpu(dev->stats);
+        sbull_store_destroy(&dev->store);
+        percpu_free_rwsem(&dev->snap_sem);
+}
+
+/*
+ * home_node= if given for this device, else deal the devices out over the
+ * nodes that have memory.
+ */
+static int sbull_home_node(int which)
+{
+        int node, n;
+
+        if (which < nr_home_node)
+                return home_node[which] < 0 ? NUMA_NO_NODE : home_node[which];
+
+        n = which % num_node_state(N_MEMORY);
+        for_each_node_state(node, N_MEMORY) {
+                if (!n--)
+                        return node;
+        }
+        return NUMA_NO_NODE;
+}
+
+/*
+ * Snapshots, too.  In slot order: a snapshot still being taken of a
+ * device as it goes away lands in a later slot, so it is not missed.
+ */
+static void sbull_remove_devices(void)
+{
+        int i;
+
+        for (i = 0; i < SBULL_MAX_DEVICES; i++) {
+                if (sbull_devices[i]) {
+                        teardown_device(sbull_devices[i]);
+                        kfree(sbull_devices[i]);
+                }
+        }
+        kfree(sbull_devices);
+}
+
+static int __init sbull_init(void)
+{
+        int ret, i;
+
+        /*
+         * Get registered.
+         */
+        sbull_major = register_blkdev(0, "sbull");
+        if (sbull_major <= 0) {
+                pr_err("sbull: unable to get major number\n");
+                return -EBUSY;
+        }
+
+        if (nr_devices < 1 || nr_devices > SBULL_MAX_DEVICES) {
+                pr_err("sbull: nr_devices must be 1..%d\n", SBULL_MAX_DEVICES);
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        for (i = 0; i < nr_home_node; i++) {
+                if (home_node[i] >= 0 && (home_node[i] >= MAX_NUMNODES ||
+                                          !node_state(home_node[i], N_MEMORY))) {
+                        pr_err("sbull: node %d has no memory\n", home_node[i]);
+                        ret = -EINVAL;
+                        goto out_unregister;
+                }
+        }
+        if (poll_queues < 0 || (poll_queues && queue_mode != SBULL_Q_MQ)) {
+                pr_err("sbull: poll_queues needs queue_mode=1\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (pcp_pages < 0 || pcp_pages > SBULL_PCP_MAX || page_reserve < 0) {
+                pr_err("sbull: pcp_pages must be 0..%d and page_reserve not negative\n",
+                       SBULL_PCP_MAX);
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (chunk_order < 0 || chunk_order > MAX_ORDER) {
+                pr_err("sbull: chunk_order must be 0..%d\n", MAX_ORDER);
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (nr_backing_file && (chunk_order || dedup || (comp_algorithm && *comp_algorithm))) {
+                pr_err("sbull: backing_file only works with plain pages\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if ((nr_populate_mb || populate_pin) &&
+            (nr_backing_file || dedup || (comp_algorithm && *comp_algorithm))) {
+                pr_err("sbull: populate_mb and populate_pin only work with plain pages or chunks\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (zoned && (nr_populate_mb || populate_pin || nr_image)) {
+                pr_err("sbull: zoned can't be combined with populate_mb, populate_pin or image\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (zoned && async_io && queue_mode != SBULL_Q_MQ) {
+                pr_err("sbull: zoned can't be combined with async_io in bio mode, whose per-CPU workers can reorder writes to a zone\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (zoned && (!is_power_of_2(zone_size_mb) || zone_capacity_mb > zone_size_mb ||
+                      (zone_size_mb << 20) < (PAGE_SIZE << chunk_order))) {
+                pr_err("sbull: zone_size_mb must be a power of two, no smaller than a chunk, and no smaller than zone_capacity_mb\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (populate_threads < 0) {
+                pr_err("sbull: populate_threads can't be negative\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (nr_backing_file && !mem_limit_mb) {
+                pr_err("sbull: backing_file needs mem_limit_mb\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+        if (chunk_order && (dedup || (comp_algorithm && *comp_algorithm))) {
+                pr_err("sbull: chunk_order can't be combined with dedup or comp_algorithm\n");
+                ret = -EINVAL;
+                goto out_unregister;
+        }
+
+        if (comp_algorithm && *comp_algorithm) {
+                if (dedup) {
+                        pr_err("sbull: dedup and comp_algorithm are exclusive\n");
+                        ret = -EINVAL;
+                        goto out_unregister;
+                }
+                sbull_zobj_cache = KMEM_CACHE(sbull_zobj, 0);
+                if (!sbull_zobj_cache) {
+                        ret = -ENOMEM;
+                        goto out_unregister;
+                }
+        } else if (dedup) {
+                sbull_dnode_cache = KMEM_CACHE(sbull_dnode, 0);
+                if (!sbull_dnode_cache) {
+                        ret = -ENOMEM;
+                        goto out_unregister;
+                }
+        }
+        if (queue_mode != SBULL_Q_MQ) {
+                sbull_cmd_cache = KMEM_CACHE(sbull_cmd, 0);
+                if (!sbull_cmd_cache) {
+                        ret = -ENOMEM;
+                        goto out_cache;
+                }
+        }
+        if (async_io) {
+                sbull_wq = alloc_workqueue("sbull", WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+                if (!sbull_wq) {
+                        ret = -ENOMEM;
+                        goto out_cache;
+                }
+        }
+        if ((pcp_pages || page_reserve) && !chunk_order && !(comp_algorithm && *comp_algorithm)) {
+                sbull_alloc_wq = alloc_workqueue("sbull_alloc", WQ_MEM_RECLAIM, 0);
+                if (!sbull_alloc_wq) {
+                        ret = -ENOMEM;
+                        goto out_cache;
+                }
+        }
+
+        sbull_devices = kcalloc(SBULL_MAX_DEVICES, sizeof(*sbull_devices), GFP_KERNEL);
+        if (!sbull_devices) {
+                ret = -ENOMEM;
+                goto out_cache;
+        }
+        for (i = 0; i < nr_devices; i++) {
+                int node = sbull_home_node(i);
+                struct sbull_dev *dev = kzalloc_node(sizeof(*dev), GFP_KERNEL, node);
+
+                if (!dev) {
+                        ret = -ENOMEM;
+                        goto out_devices;
+                }
+                ret = setup_device(dev, i, node, NULL);
+                if (ret) {
+                        kfree(dev);
+                        goto out_devices;
+                }
+                sbull_devices[i] = dev;
+        }
+
+        // TODO: You can add data structure initialization here if needed
+
+        return 0;
+
+ out_devices:
+        sbull_remove_devices();
+ out_cache:
+        if (sbull_wq)
+                destroy_workqueue(sbull_wq);
+        if (sbull_alloc_wq)
+                destroy_workqueue(sbull_alloc_wq);
+        kmem_cache_destroy(sbull_cmd_cache);
+        kmem_cache_destroy(sbull_dnode_cache);
+        kmem_cache_destroy(sbull_zobj_cache);
+ out_unregister:
+        unregister_blkdev(sbull_major, "sbull");
+        return ret;
+}
+
+static void sbull_exit(void)
+{
+        sbull_remove_devices();
+        unregister_blkdev(sbull_major, "sbull");
+        rcu_barrier();          /* wait for pages freed by discard */
+        if (sbull_wq)
+                destroy_workqueue(sbull_wq);
+        if (sbull_alloc_wq)
+                destroy_workqueue(sbull_alloc_wq);
+        kmem_cache_destroy(sbull_cmd_cache);
+        kmem_cache_destroy(sbull_dnode_cache);
+        kmem_cache_destroy(sbull_zobj_cache);
+}
+
+module_init(sbull_init);
+module_exit(sbull_exit);
+
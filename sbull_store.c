@@ -0,0 +1,533 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
+/*
+ * The sbull page store; see sbull_store.h.  A transfer is handled in
+ * windows of SBULL_BATCH consecutive entries.  A window never leaves its
+ * stripe, so it lives in one shard under consecutive keys and one xas
+ * walk resolves all of it; writes allocate whatever the window is
+ * missing in one go, and the copy loop then runs against the table
+ * without searching the index again.
+ */
+#ifdef __KERNEL__
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/bitmap.h>
+#include <linux/highmem.h>
+#include <linux/rcupdate.h>
+#include <linux/string.h>
+#include <linux/blk_types.h>
+#endif
+
+#include "sbull_store.h"
+
+void sbull_store_init_shards(struct sbull_store_shard *shards)
+{
+        int i;
+
+        for (i = 0; i < SBULL_SHARDS; i++) {
+                xa_init(&shards[i].pages);
+                init_rwsem(&shards[i].evict_sem);
+        }
+}
+
+static void sbull_store_free_rcu(struct rcu_head *head)
+{
+        struct page *page = container_of(head, struct page, rcu_head);
+
+        __free_pages(page, compound_order(page));
+}
+
+/* The plain-page ->retire. */
+static void sbull_store_retire(struct sbull_store *s, void *entry)
+{
+        struct page *page = entry;
+
+        if (xa_is_value(entry)) {
+                percpu_counter_dec(&s->nr_same);
+                return;
+        }
+        percpu_counter_dec(&s->nr_pages);
+        call_rcu(&page->rcu_head, sbull_store_free_rcu);
+}
+
+/* The plain-page ->insert: a new page, holding the fill @old stood for. */
+static int sbull_store_insert(struct sbull_store *s, unsigned long idx, void *old)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_store_xa(s, idx, &key);
+        struct page *page;
+        void *cur;
+
+        page = alloc_pages_node(s->node, GFP_NOIO | __GFP_ZERO |
+                                (s->chunk_order ? __GFP_COMP : 0), s->chunk_order);
+        if (!page)
+                return -ENOMEM;
+        if (old)
+                memset32(page_address(page), xa_to_value(old), PAGE_SIZE / sizeof(u32));
+
+        cur = xa_cmpxchg(xa, key, old, page, GFP_NOIO);
+        if (cur != old) {
+                __free_pages(page, s->chunk_order);
+                return xa_err(cur);
+        }
+        percpu_counter_inc(&s->nr_pages);
+        if (old)
+                percpu_counter_dec(&s->nr_same);
+        return 0;
+}
+
+static const struct sbull_store_ops sbull_store_plain_ops = {
+        .insert = sbull_store_insert,
+        .retire = sbull_store_retire,
+};
+
+/*
+ * Set up @s over @shards, which sbull_store_init_shards() has set up, as
+ * a plain-page store of @size bytes.  The owner may then set chunks,
+ * pinning, eviction and its own ops before the first transfer.
+ */
+int sbull_store_init(struct sbull_store *s, struct sbull_store_shard *shards,
+                     unsigned long size, int node)
+{
+        int ret;
+
+        memset(s, 0, sizeof(*s));
+        s->shards = shards;
+        s->ops = &sbull_store_plain_ops;
+        s->size = size;
+        s->node = node;
+        s->chunk_shift = PAGE_SHIFT;
+        ret = percpu_counter_init(&s->nr_pages, 0, GFP_KERNEL);
+        if (ret)
+                return ret;
+        ret = percpu_counter_init(&s->nr_same, 0, GFP_KERNEL);
+        if (ret)
+                percpu_counter_destroy(&s->nr_pages);
+        return ret;
+}
+
+void sbull_store_destroy(struct sbull_store *s)
+{
+        percpu_counter_destroy(&s->nr_same);
+        percpu_counter_destroy(&s->nr_pages);
+}
+
+/*
+ * Drop everything in the store's index through ->retire and wait for it
+ * to be freed.  No transfer may be running.
+ */
+void sbull_store_clear(struct sbull_store *s)
+{
+        unsigned long key;
+        void *entry;
+        int i;
+
+        for (i = 0; i < SBULL_SHARDS; i++) {
+                struct xarray *xa = &s->shards[i].pages;
+
+                xa_for_each(xa, key, entry) {
+                        xa_erase(xa, key);
+                        s->ops->retire(s, entry);
+                }
+                xa_destroy(xa);
+        }
+        rcu_barrier();
+}
+
+/*
+ * Record page @idx as filled with @fill, dropping whatever backed it.
+ * Replacing an entry that is already there never allocates, so callers
+ * under RCU pass GFP_NOWAIT for that case.
+ */
+int sbull_store_fill(struct sbull_store *s, unsigned long idx, u32 fill, gfp_t gfp)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_store_xa(s, idx, &key);
+        void *old;
+
+        old = xa_store(xa, key, xa_mk_value(fill), gfp);
+        if (xa_is_err(old))
+                return xa_err(old);
+
+        percpu_counter_inc(&s->nr_same);
+        if (old)
+                s->ops->retire(s, old);
+        return 0;
+}
+
+/*
+ * The caller's side of a transfer: a bvec walk, as in a bio, or a flat
+ * buffer if @bvec is NULL.
+ */
+struct sbull_store_buf {
+        const struct bio_vec *bvec;
+        struct bvec_iter iter;
+        char *addr;
+};
+
+/* Map the next piece of @b, @max bytes at most; *@len says how much it is. */
+static inline char *sbull_buf_map(struct sbull_store_buf *b, unsigned long max,
+                                  unsigned int *len)
+{
+        struct bio_vec bv;
+
+        if (!b->bvec) {
+                *len = max;
+                return b->addr;
+        }
+        bv = bvec_iter_bvec(b->bvec, b->iter);
+        *len = min_t(unsigned long, bv.bv_len, max);
+        return (char *)kmap_local_page(bv.bv_page) + bv.bv_offset;
+}
+
+static inline void sbull_buf_unmap(struct sbull_store_buf *b, char *mem)
+{
+        if (b->bvec)
+                kunmap_local(mem);
+}
+
+static inline void sbull_buf_advance(struct sbull_store_buf *b, unsigned int len)
+{
+        if (b->bvec)
+                bvec_iter_advance_single(b->bvec, &b->iter, len);
+        else
+                b->addr += len;
+}
+
+struct sbull_window {
+        unsigned long base;                     /* first entry index */
+        void *entry[SBULL_BATCH];
+        DECLARE_BITMAP(filled, SBULL_BATCH);    /* written whole and same-filled */
+        u32 fill[SBULL_BATCH];
+};
+
+/*
+ * Fill in the entries of window @win.  Must be called under
+ * rcu_read_lock(), and the entries are only good until it is dropped.
+ */
+static void sbull_store_lookup(struct sbull_store *s, struct sbull_window *win)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_store_xa(s, win->base, &key);
+        XA_STATE(xas, xa, key);
+        void *entry;
+
+        memset(win->entry, 0, sizeof(win->entry));
+        xas_for_each(&xas, entry, key + SBULL_BATCH - 1) {
+                if (xas_retry(&xas, entry))
+                        continue;
+                win->entry[xas.xa_index - key] = entry;
+        }
+        if (s->ops->walked)
+                s->ops->walked(s, xa, win->base, win->entry);
+}
+
+/*
+ * Note which pages of the window a write of @b over [pos, end) covers
+ * whole with one 32-bit word repeated; those become fill entries rather
+ * than being copied.  @b is the caller's copy, so this doesn't move it.
+ */
+static void sbull_store_scan_fills(struct sbull_store *s, struct sbull_window *win,
+                                   struct sbull_store_buf b, unsigned long pos,
+                                   unsigned long end)
+{
+        bitmap_zero(win->filled, SBULL_BATCH);
+        if (s->chunk_order || s->pinned)
+                return;
+
+        while (pos < end) {
+                unsigned int i = (pos >> PAGE_SHIFT) - win->base;
+                unsigned int len;
+                char *mem = sbull_buf_map(&b, min_t(unsigned long, end - pos,
+                                                    PAGE_SIZE - offset_in_page(pos)), &len);
+
+                if (len == PAGE_SIZE && sbull_page_same_filled(mem, &win->fill[i]))
+                        __set_bit(i, win->filled);
+                sbull_buf_unmap(&b, mem);
+                sbull_buf_advance(&b, len);
+                pos += len;
+        }
+}
+
+/*
+ * Does entry @i of the window need work before it can be copied from, or
+ * for a write into?  Evicted pages must be brought back first.  For a
+ * write holes always do, and fill entries unless they are about to be
+ * overwritten by another fill.
+ */
+static inline bool sbull_window_hole(struct sbull_window *win, unsigned int i,
+                                     bool write)
+{
+        void *entry = win->entry[i];
+
+        if (sbull_is_evicted(entry))
+                return !test_bit(i, win->filled);
+        if (!write)
+                return false;
+        return !entry || (xa_is_value(entry) && !test_bit(i, win->filled));
+}
+
+/*
+ * Make entries [first, last] of the window ready, outside RCU since
+ * allocating may sleep.
+ */
+static int sbull_store_populate(struct sbull_store *s, struct sbull_window *win,
+                                unsigned int first, unsigned int last, bool write)
+{
+        unsigned int i;
+        int ret;
+
+        for (i = first; i <= last; i++) {
+                if (!sbull_window_hole(win, i, write))
+                        continue;
+                if (test_bit(i, win->filled))
+                        ret = sbull_store_fill(s, win->base + i, win->fill[i], GFP_NOIO);
+                else
+                        ret = s->ops->insert(s, win->base + i, win->entry[i]);
+                if (ret)
+                        return ret;
+        }
+        return 0;
+}
+
+/*
+ * Copy @nbytes at @pos to or from the window they fall in, with
+ * non-temporal stores if @nt.  Runs under rcu_read_lock().
+ */
+static int sbull_store_copy(struct sbull_store *s, struct sbull_window *win,
+                            unsigned long pos, char *buf, unsigned int nbytes,
+                            bool write, bool nt)
+{
+        while (nbytes) {
+                unsigned long chunk = 1UL << s->chunk_shift;
+                unsigned int i = (pos >> s->chunk_shift) - win->base;
+                unsigned int off = pos & (chunk - 1);
+                unsigned int len = min_t(unsigned long, nbytes, chunk - off);
+                void *entry = win->entry[i];
+
+                sbull_store_touch(s, win->base + i);
+                if (!write) {
+                        if (!entry)
+                                memset(buf, 0, len);
+                        else if (xa_is_value(entry))
+                                memset32((u32 *)buf, xa_to_value(entry), len / sizeof(u32));
+                        else if (nt)
+                                memcpy_flushcache(buf, page_address(entry) + off, len);
+                        else
+                                memcpy(buf, page_address(entry) + off, len);
+                } else {
+                        if (test_bit(i, win->filled)) {
+                                void *fill = xa_mk_value(win->fill[i]);
+
+                                if (entry == fill)
+                                        goto next;
+                                if (!sbull_store_fill(s, win->base + i, win->fill[i], GFP_NOWAIT)) {
+                                        win->entry[i] = fill;
+                                        goto next;
+                                }
+                                if (xa_is_value(entry))
+                                        return -ENOMEM;
+                                /* else just copy it into the page after all */
+                        }
+                        if (nt)
+                                memcpy_flushcache(page_address(entry) + off, buf, len);
+                        else
+                                memcpy(page_address(entry) + off, buf, len);
+                        sbull_store_mark_dirty(s, win->base + i);
+                }
+next:
+                pos += len;
+                buf += len;
+                nbytes -= len;
+        }
+        return 0;
+}
+
+static int sbull_store_xfer(struct sbull_store *s, unsigned long pos, unsigned long len,
+                            struct sbull_store_buf *b, bool write, bool nt)
+{
+        unsigned long end = pos + len;
+        struct sbull_window win;
+        int ret = 0;
+
+        if (end > s->size || end < pos)
+                return -EIO;    /* beyond end */
+
+        while (pos < end) {
+                unsigned long idx = pos >> s->chunk_shift;
+                unsigned long wend;
+                unsigned int i, first, last;
+
+                win.base = round_down(idx, SBULL_BATCH);
+                wend = min(end, (win.base + SBULL_BATCH) << s->chunk_shift);
+                first = idx - win.base;
+                last = ((wend - 1) >> s->chunk_shift) - win.base;
+                if (write)
+                        sbull_store_scan_fills(s, &win, *b, pos, wend);
+                else
+                        bitmap_zero(win.filled, SBULL_BATCH);
+
+                if (write)
+                        sbull_store_write_lock(s, win.base);
+                rcu_read_lock();
+                sbull_store_lookup(s, &win);
+                if (!write && s->ops->lookup_below)
+                        s->ops->lookup_below(s, win.base, win.entry);
+                for (i = first; i <= last; i++) {
+                        if (sbull_window_hole(&win, i, write))
+                                break;
+                }
+                if (i <= last) {
+                        rcu_read_unlock();
+                        if (write)
+                                sbull_store_write_unlock(s, win.base);
+                        ret = sbull_store_populate(s, &win, first, last, write);
+                        if (ret)
+                                break;
+                        continue;       /* and look the window up again */
+                }
+
+                while (pos < wend) {
+                        unsigned int n;
+                        char *buf = sbull_buf_map(b, wend - pos, &n);
+
+                        ret = sbull_store_copy(s, &win, pos, buf, n, write, nt);
+                        sbull_buf_unmap(b, buf);
+                        if (ret)
+                                break;
+                        sbull_buf_advance(b, n);
+                        pos += n;
+                }
+                /* Non-temporal stores are weakly ordered: done before anyone looks. */
+                if (nt)
+                        wmb();
+                rcu_read_unlock();
+                if (write)
+                        sbull_store_write_unlock(s, win.base);
+                if (ret)
+                        break;
+        }
+        return ret;
+}
+
+int sbull_store_read(struct sbull_store *s, unsigned long pos, void *buf,
+                     unsigned long len)
+{
+        struct sbull_store_buf b = { .addr = buf };
+
+        return sbull_store_xfer(s, pos, len, &b, false, false);
+}
+
+int sbull_store_write(struct sbull_store *s, unsigned long pos, const void *buf,
+                      unsigned long len)
+{
+        struct sbull_store_buf b = { .addr = (char *)buf };
+
+        return sbull_store_xfer(s, pos, len, &b, true, false);
+}
+
+/*
+ * The same for the segments @iter covers of @bvec, as in a bio: the
+ * transfer starts at iter.bi_sector and is iter.bi_size long.  With @nt,
+ * the copies use non-temporal stores.
+ */
+int sbull_store_read_bvec(struct sbull_store *s, const struct bio_vec *bvec,
+                          struct bvec_iter iter, bool nt)
+{
+        struct sbull_store_buf b = { .bvec = bvec, .iter = iter };
+
+        return sbull_store_xfer(s, (unsigned long)iter.bi_sector << SECTOR_SHIFT,
+                                iter.bi_size, &b, false, nt);
+}
+
+int sbull_store_write_bvec(struct sbull_store *s, const struct bio_vec *bvec,
+                           struct bvec_iter iter, bool nt)
+{
+        struct sbull_store_buf b = { .bvec = bvec, .iter = iter };
+
+        return sbull_store_xfer(s, (unsigned long)iter.bi_sector << SECTOR_SHIFT,
+                                iter.bi_size, &b, true, nt);
+}
+
+/*
+ * Drop entry @idx.  If the data under it, @below, would show through a
+ * hole, it becomes a zero fill instead.
+ */
+static int sbull_store_drop(struct sbull_store *s, unsigned long idx, void *below)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_store_xa(s, idx, &key);
+        void *entry;
+
+        if (below)
+                return sbull_store_fill(s, idx, 0, GFP_NOIO);
+
+        entry = xa_erase(xa, key);
+        if (entry)
+                s->ops->retire(s, entry);
+        return 0;
+}
+
+/* Zero @len bytes at @pos, within entry @idx, if it holds anything. */
+static int sbull_store_zero(struct sbull_store *s, unsigned long idx, unsigned long pos,
+                            unsigned long len, void *below)
+{
+        unsigned long key;
+        struct xarray *xa = sbull_store_xa(s, idx, &key);
+        unsigned int n;
+        int ret;
+
+        if (!below && !xa_load(xa, key))
+                return 0;
+
+        for (; len; pos += n, len -= n) {
+                n = min_t(unsigned long, len, PAGE_SIZE);
+                ret = sbull_store_write(s, pos, page_address(ZERO_PAGE(0)), n);
+                if (ret)
+                        return ret;
+        }
+        return 0;
+}
+
+/*
+ * Discard and write-zeroes: whole entries are dropped from the index,
+ * unless the store is pinned, and partially covered ones are zeroed.
+ * Either way the range then reads back as zeroes.
+ */
+int sbull_store_discard(struct sbull_store *s, unsigned long pos, unsigned long len)
+{
+        unsigned long end = pos + len;
+        unsigned long chunk = 1UL << s->chunk_shift;
+        void *below[SBULL_BATCH];
+        int ret;
+
+        if (end > s->size || end < pos)
+                return -EIO;    /* beyond end */
+
+        while (pos < end) {
+                unsigned long base = round_down(pos >> s->chunk_shift, SBULL_BATCH);
+                unsigned long wend = min(end, (base + SBULL_BATCH) << s->chunk_shift);
+
+                /* Only compared with NULL, so good past rcu_read_unlock(). */
+                memset(below, 0, sizeof(below));
+                if (s->ops->lookup_below) {
+                        rcu_read_lock();
+                        s->ops->lookup_below(s, base, below);
+                        rcu_read_unlock();
+                }
+
+                while (pos < wend) {
+                        unsigned long idx = pos >> s->chunk_shift;
+                        unsigned long off = pos & (chunk - 1);
+                        unsigned long n = min(wend - pos, chunk - off);
+
+                        if (n == chunk && !s->pinned)
+                                ret = sbull_store_drop(s, idx, below[idx - base]);
+                        else
+                                ret = sbull_store_zero(s, idx, pos, n, below[idx - base]);
+                        if (ret)
+                                return ret;
+                        pos += n;
+                }
+        }
+        return 0;
+}
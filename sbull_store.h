@@ -0,0 +1,219 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause) */
+/*
+ * The sbull page store core (sbull_store.c): the page index and the
+ * windowed transfer path over it, linked into sbull2 and used for all of
+ * its plain-page and chunk I/O.  sbull2 adds snapshots, eviction and its
+ * page caches through struct sbull_store_ops.  The core is written
+ * against the kernel's own interfaces and builds unchanged in userspace
+ * on top of user/kshim.h, which supplies the part of them it uses, so
+ * index changes can be tried and profiled with perf or valgrind on an
+ * ordinary box before they go into the driver (see user/).
+ */
+#ifndef _SBULL_STORE_H
+#define _SBULL_STORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/cache.h>
+#include <linux/kernel.h>
+#include <linux/xarray.h>
+#include <linux/bvec.h>
+#include <linux/rwsem.h>
+#include <linux/percpu_counter.h>
+#else
+#include "kshim.h"
+#endif
+
+/*
+ * The page index is split into SBULL_SHARDS xarrays, each with its own
+ * xa_lock on its own cache line, so writers that insert pages only
+ * contend with writers hitting the same shard.  Runs of
+ * SBULL_STRIPE_PAGES consecutive pages (one xarray leaf node) go to the
+ * same shard, and the stripes are dealt out round-robin.
+ */
+#define SBULL_SHARD_BITS        6
+#define SBULL_SHARDS            (1 << SBULL_SHARD_BITS)
+#define SBULL_STRIPE_BITS       6
+#define SBULL_STRIPE_PAGES      (1 << SBULL_STRIPE_BITS)
+
+/* Transfers walk the index this many entries, within a stripe, at a time. */
+#define SBULL_BATCH             32
+
+/* The shard page @idx lives in, and its key there. */
+static inline unsigned int sbull_index_key(unsigned long idx, unsigned long *key)
+{
+        unsigned long stripe = idx >> SBULL_STRIPE_BITS;
+
+        *key = (stripe >> SBULL_SHARD_BITS) << SBULL_STRIPE_BITS |
+               (idx & (SBULL_STRIPE_PAGES - 1));
+        return stripe & (SBULL_SHARDS - 1);
+}
+
+/* And back: the page index of @key in @shard. */
+static inline unsigned long sbull_shard_idx(unsigned int shard, unsigned long key)
+{
+        return ((key >> SBULL_STRIPE_BITS) << SBULL_SHARD_BITS | shard) << SBULL_STRIPE_BITS |
+               (key & (SBULL_STRIPE_PAGES - 1));
+}
+
+/*
+ * Is the page at @mem one 32-bit word repeated?  Compares a long at a
+ * time, four per iteration, after checking the last word so that most
+ * ordinary pages bail out on the first cache line.  A fill that would not
+ * fit in an xarray value entry next to the SBULL_EVICTED marker below
+ * doesn't count.
+ */
+static inline bool sbull_page_same_filled(const void *mem, u32 *fill)
+{
+        const unsigned long *p = mem;
+        unsigned long val = p[0];
+        unsigned int i, last = PAGE_SIZE / sizeof(*p) - 1;
+
+        if (p[last] != val)
+                return false;
+        if (BITS_PER_LONG == 64 && upper_32_bits(val) != lower_32_bits(val))
+                return false;
+        if (BITS_PER_LONG == 32 && val >= LONG_MAX)
+                return false;
+
+        for (i = 0; i < last; i += 4) {
+                if (p[i] != val || p[i + 1] != val ||
+                    p[i + 2] != val || p[i + 3] != val)
+                        return false;
+        }
+
+        *fill = lower_32_bits(val);
+        return true;
+}
+
+/*
+ * With a backing file, a page that was moved out to it is held as this
+ * value entry, out of the range of fills; the store's ->insert brings it
+ * back.
+ */
+#define SBULL_EVICTED           xa_mk_value(LONG_MAX)
+
+static inline bool sbull_is_evicted(const void *entry)
+{
+        return entry == SBULL_EVICTED;
+}
+
+struct sbull_store_shard {
+        struct xarray pages;            /* shard key -> struct page */
+        struct rw_semaphore evict_sem;  /* evictable: writers shared, evictor exclusive */
+} ____cacheline_aligned_in_smp;
+
+struct sbull_store;
+
+/*
+ * What the store's owner adds to it.  ->insert and ->retire are always
+ * set (sbull_store_init() puts in the plain-page ones); the rest are
+ * optional.
+ */
+struct sbull_store_ops {
+        /*
+         * Make entry @idx, now @old (NULL, a fill or SBULL_EVICTED), a
+         * page with the data it stands for.  May sleep.  Losing the race
+         * to another writer is fine.
+         */
+        int (*insert)(struct sbull_store *s, unsigned long idx, void *old);
+        /* @entry has just left the index: account for it, free it after a grace period. */
+        void (*retire)(struct sbull_store *s, void *entry);
+        /*
+         * Fill the holes in @entry, the window of SBULL_BATCH entries at
+         * @base, from wherever else the data is (sbull2's snapshot layers);
+         * those entries are never written through.  Under rcu_read_lock().
+         */
+        void (*lookup_below)(struct sbull_store *s, unsigned long base, void **entry);
+        /* The window at @base has just been looked up in @xa; for statistics. */
+        void (*walked)(struct sbull_store *s, struct xarray *xa, unsigned long base,
+                       void **entry);
+};
+
+/*
+ * A store: the index and the fast path over it.  Entries are pages, or
+ * compound pages of 2^chunk_order when that is set, allocated as writes
+ * first reach them; same-filled whole-page writes become value entries
+ * unless the store has chunks or is pinned.  Lookups are lock-free under
+ * RCU, and the index is walked SBULL_BATCH entries at a time.
+ *
+ * An evictable store has its pages written back and moved out by its
+ * owner, holding the shard's evict_sem exclusive; writers into pages hold
+ * it shared and mark what they use in @ref and what they change in
+ * @dirty, one bit per entry.
+ */
+struct sbull_store {
+        struct sbull_store_shard *shards;       /* SBULL_SHARDS of them: the index written */
+        const struct sbull_store_ops *ops;
+        unsigned long size;                     /* in bytes */
+        int node;                               /* where pages come from */
+        unsigned int chunk_order;               /* each entry covers 2^chunk_order pages */
+        unsigned int chunk_shift;               /* PAGE_SHIFT + chunk_order */
+        bool pinned;                            /* entries are never dropped nor become fills */
+        bool evictable;
+        unsigned long *ref;                     /* evictable: used since the evictor last passed */
+        unsigned long *dirty;                   /* evictable: newer than the evicted copy */
+        struct percpu_counter nr_pages;         /* entries with memory behind them */
+        struct percpu_counter nr_same;          /* same-filled pages, no memory */
+};
+
+static inline struct xarray *sbull_store_xa(struct sbull_store *s, unsigned long idx,
+                                            unsigned long *key)
+{
+        return &s->shards[sbull_index_key(idx, key)].pages;
+}
+
+/*
+ * Entry @idx was just used: the evictor will pass it over once.  Only
+ * dirty the bitmap's cache line if the bit isn't already set.
+ */
+static inline void sbull_store_touch(struct sbull_store *s, unsigned long idx)
+{
+        if (s->ref && !test_bit(idx, s->ref))
+                set_bit(idx, s->ref);
+}
+
+static inline void sbull_store_mark_dirty(struct sbull_store *s, unsigned long idx)
+{
+        if (s->dirty && !test_bit(idx, s->dirty))
+                set_bit(idx, s->dirty);
+        sbull_store_touch(s, idx);
+}
+
+/*
+ * Writes into pages in place are shut out while the evictor copies pages
+ * of that shard out, so none can slip in behind the copy.
+ */
+static inline void sbull_store_write_lock(struct sbull_store *s, unsigned long idx)
+{
+        unsigned long key;
+
+        if (s->evictable)
+                down_read(&s->shards[sbull_index_key(idx, &key)].evict_sem);
+}
+
+static inline void sbull_store_write_unlock(struct sbull_store *s, unsigned long idx)
+{
+        unsigned long key;
+
+        if (s->evictable)
+                up_read(&s->shards[sbull_index_key(idx, &key)].evict_sem);
+}
+
+void sbull_store_init_shards(struct sbull_store_shard *shards);
+int sbull_store_init(struct sbull_store *s, struct sbull_store_shard *shards,
+                     unsigned long size, int node);
+void sbull_store_destroy(struct sbull_store *s);
+void sbull_store_clear(struct sbull_store *s);
+int sbull_store_fill(struct sbull_store *s, unsigned long idx, u32 fill, gfp_t gfp);
+int sbull_store_read(struct sbull_store *s, unsigned long pos, void *buf,
+                     unsigned long len);
+int sbull_store_write(struct sbull_store *s, unsigned long pos, const void *buf,
+                      unsigned long len);
+int sbull_store_read_bvec(struct sbull_store *s, const struct bio_vec *bvec,
+                          struct bvec_iter iter, bool nt);
+int sbull_store_write_bvec(struct sbull_store *s, const struct bio_vec *bvec,
+                           struct bvec_iter iter, bool nt);
+int sbull_store_discard(struct sbull_store *s, unsigned long pos, unsigned long len);
+
+#endif /* _SBULL_STORE_H */
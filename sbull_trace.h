@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause) */
+/*
+ * Tracepoints for the sbull2 I/O path.  With tracing off each costs a
+ * patched-out branch; turn them on with e.g.
+ *
+ *   echo 1 > /sys/kernel/tracing/events/sbull/enable
+ *   perf record -e 'sbull:*' ...
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sbull
+
+#if !defined(_SBULL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SBULL_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/blktrace_api.h>
+
+TRACE_EVENT(sbull_bio_submit,
+
+        TP_PROTO(struct bio *bio),
+
+        TP_ARGS(bio),
+
+        TP_STRUCT__entry(
+                __field(dev_t, dev)
+                __field(sector_t, sector)
+                __field(unsigned int, nr_sector)
+                __array(char, rwbs, RWBS_LEN)
+        ),
+
+        TP_fast_assign(
+                __entry->dev = bio_dev(bio);
+                __entry->sector = bio->bi_iter.bi_sector;
+                __entry->nr_sector = bio_sectors(bio);
+                blk_fill_rwbs(__entry->rwbs, bio->bi_opf);
+        ),
+
+        TP_printk("%d,%d %s %llu + %u",
+                  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->rwbs,
+                  (unsigned long long)__entry->sector, __entry->nr_sector)
+);
+
+TRACE_EVENT(sbull_bio_complete,
+
+        TP_PROTO(struct bio *bio, sector_t sector, blk_status_t status, u64 ns),
+
+        TP_ARGS(bio, sector, status, ns),
+
+        TP_STRUCT__entry(
+                __field(dev_t, dev)
+                __field(sector_t, sector)
+                __field(int, error)
+                __field(u64, ns)
+                __array(char, rwbs, RWBS_LEN)
+        ),
+
+        TP_fast_assign(
+                __entry->dev = bio_dev(bio);
+                __entry->sector = sector;
+                __entry->error = blk_status_to_errno(status);
+                __entry->ns = ns;
+                blk_fill_rwbs(__entry->rwbs, bio->bi_opf);
+        ),
+
+        TP_printk("%d,%d %s %llu error=%d %lluns",
+                  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->rwbs,
+                  (unsigned long long)__entry->sector, __entry->error,
+                  __entry->ns)
+);
+
+TRACE_EVENT(sbull_page_alloc,
+
+        TP_PROTO(unsigned long idx, unsigned int order),
+
+        TP_ARGS(idx, order),
+
+        TP_STRUCT__entry(
+                __field(unsigned long, idx)
+                __field(unsigned int, order)
+        ),
+
+        TP_fast_assign(
+                __entry->idx = idx;
+                __entry->order = order;
+        ),
+
+        TP_printk("idx=%lu order=%u", __entry->idx, __entry->order)
+);
+
+DECLARE_EVENT_CLASS(sbull_lookup,
+
+        TP_PROTO(unsigned long idx),
+
+        TP_ARGS(idx),
+
+        TP_STRUCT__entry(
+                __field(unsigned long, idx)
+        ),
+
+        TP_fast_assign(
+                __entry->idx = idx;
+        ),
+
+        TP_printk("idx=%lu", __entry->idx)
+);
+
+DEFINE_EVENT(sbull_lookup, sbull_lookup_hit,
+        TP_PROTO(unsigned long idx),
+        TP_ARGS(idx)
+);
+
+DEFINE_EVENT(sbull_lookup, sbull_lookup_miss,
+        TP_PROTO(unsigned long idx),
+        TP_ARGS(idx)
+);
+
+#endif /* _SBULL_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sbull_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,355 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
+/*
+ * Userspace stand-ins for kernel interfaces; see kshim.h.
+ */
+#include "kshim.h"
+
+/* Pages */
+
+static char kshim_zero[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+struct page kshim_zero_page = { .addr = kshim_zero };
+
+struct page *alloc_pages_node(int node, gfp_t gfp, unsigned int order)
+{
+        struct page *page = malloc(sizeof(*page));
+
+        if (!page)
+                return NULL;
+        page->addr = aligned_alloc(PAGE_SIZE, PAGE_SIZE << order);
+        if (!page->addr) {
+                free(page);
+                return NULL;
+        }
+        if (gfp & __GFP_ZERO)
+                memset(page->addr, 0, PAGE_SIZE << order);
+        return page;
+}
+
+void __free_pages(struct page *page, unsigned int order)
+{
+        free(page->addr);
+        free(page);
+}
+
+/* Percpu counters */
+
+static _Atomic unsigned int kshim_next_slot;
+static __thread unsigned int kshim_my_slot = -1U;
+
+unsigned int kshim_slot(void)
+{
+        if (unlikely(kshim_my_slot == -1U))
+                kshim_my_slot = atomic_fetch_add(&kshim_next_slot, 1) % KSHIM_SLOTS;
+        return kshim_my_slot;
+}
+
+/* RCU */
+
+#define KSHIM_RCU_BATCH         1024
+
+__thread struct kshim_rcu_reader *kshim_rcu_self;
+static _Atomic(struct kshim_rcu_reader *) kshim_rcu_readers;
+
+static pthread_mutex_t kshim_rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu_head *kshim_rcu_pending;
+static unsigned int kshim_rcu_nr_pending;
+
+/* Readers are never unregistered: a thread that has gone reads as idle. */
+struct kshim_rcu_reader *kshim_rcu_register(void)
+{
+        struct kshim_rcu_reader *r = aligned_alloc(L1_CACHE_BYTES, sizeof(*r));
+
+        if (!r)
+                abort();
+        atomic_init(&r->ctr, 0);
+        r->nesting = 0;
+        r->next = atomic_load(&kshim_rcu_readers);
+        while (!atomic_compare_exchange_weak(&kshim_rcu_readers, &r->next, r))
+                ;
+        kshim_rcu_self = r;
+        return r;
+}
+
+void synchronize_rcu(void)
+{
+        struct kshim_rcu_reader *r;
+
+        atomic_thread_fence(memory_order_seq_cst);
+        for (r = atomic_load(&kshim_rcu_readers); r; r = r->next) {
+                unsigned long ctr = atomic_load_explicit(&r->ctr, memory_order_acquire);
+
+                if (!(ctr & 1))
+                        continue;
+                while (atomic_load_explicit(&r->ctr, memory_order_acquire) == ctr)
+                        sched_yield();
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void kshim_rcu_run(struct rcu_head *head)
+{
+        struct rcu_head *next;
+
+        if (!head)
+                return;
+        synchronize_rcu();
+        for (; head; head = next) {
+                next = head->next;
+                head->func(head);
+        }
+}
+
+static struct rcu_head *kshim_rcu_take(void)
+{
+        struct rcu_head *head = kshim_rcu_pending;
+
+        kshim_rcu_pending = NULL;
+        kshim_rcu_nr_pending = 0;
+        return head;
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+        struct rcu_head *batch = NULL;
+        bool reading = kshim_rcu_self && kshim_rcu_self->nesting;
+
+        head->func = func;
+        pthread_mutex_lock(&kshim_rcu_lock);
+        head->next = kshim_rcu_pending;
+        kshim_rcu_pending = head;
+        /* Waiting for a grace period from inside one would be forever. */
+        if (++kshim_rcu_nr_pending >= KSHIM_RCU_BATCH && !reading)
+                batch = kshim_rcu_take();
+        pthread_mutex_unlock(&kshim_rcu_lock);
+        kshim_rcu_run(batch);
+}
+
+void rcu_barrier(void)
+{
+        struct rcu_head *batch;
+
+        pthread_mutex_lock(&kshim_rcu_lock);
+        batch = kshim_rcu_take();
+        pthread_mutex_unlock(&kshim_rcu_lock);
+        kshim_rcu_run(batch);
+}
+
+/* The xarray */
+
+void xa_init(struct xarray *xa)
+{
+        pthread_mutex_init(&xa->xa_lock, NULL);
+        atomic_init(&xa->xa_head, NULL);
+}
+
+static void xa_free_node(struct xa_node *node)
+{
+        unsigned int i;
+
+        if (node->shift) {
+                for (i = 0; i < XA_CHUNK_SIZE; i++) {
+                        struct xa_node *child = atomic_load(&node->slots[i]);
+
+                        if (child)
+                                xa_free_node(child);
+                }
+        }
+        free(node);
+}
+
+void xa_destroy(struct xarray *xa)
+{
+        struct xa_node *head = atomic_load(&xa->xa_head);
+
+        if (head)
+                xa_free_node(head);
+        atomic_store(&xa->xa_head, NULL);
+        pthread_mutex_destroy(&xa->xa_lock);
+}
+
+/* Does a tree topped by @node reach @index? */
+static inline bool xa_covers(const struct xa_node *node, unsigned long index)
+{
+        unsigned int bits = node->shift + XA_CHUNK_SHIFT;
+
+        return bits >= BITS_PER_LONG || !(index >> bits);
+}
+
+/*
+ * The leaf node holding @index, if there is one.  If not, and @skip is
+ * given, set it to the first index past the hole, or 0 if nothing lies
+ * beyond it.
+ */
+static struct xa_node *xa_walk(struct xarray *xa, unsigned long index, unsigned long *skip)
+{
+        struct xa_node *node = atomic_load_explicit(&xa->xa_head, memory_order_acquire);
+        unsigned int shift = BITS_PER_LONG;
+
+        if (node && !xa_covers(node, index))
+                node = NULL;
+        else if (node)
+                shift = node->shift + XA_CHUNK_SHIFT;
+        while (node && node->shift) {
+                shift = node->shift;
+                node = atomic_load_explicit(&node->slots[(index >> node->shift) & XA_CHUNK_MASK],
+                                            memory_order_acquire);
+        }
+        if (!node && skip)
+                *skip = shift >= BITS_PER_LONG ? 0 : (index | ((1UL << shift) - 1)) + 1;
+        return node;
+}
+
+static inline struct xa_node *xa_leaf(struct xarray *xa, unsigned long index)
+{
+        return xa_walk(xa, index, NULL);
+}
+
+void *xa_load(struct xarray *xa, unsigned long index)
+{
+        struct xa_node *leaf = xa_leaf(xa, index);
+
+        if (!leaf)
+                return NULL;
+        return atomic_load_explicit(&leaf->slots[index & XA_CHUNK_MASK], memory_order_acquire);
+}
+
+static struct xa_node *xa_alloc_node(unsigned int shift)
+{
+        struct xa_node *node = calloc(1, sizeof(*node));
+
+        if (node)
+                node->shift = shift;
+        return node;
+}
+
+/*
+ * The slot for @index, growing the tree and adding nodes down to it as
+ * needed, or NULL if out of memory.  Called under xa_lock; a new node
+ * is only published once it is complete.
+ */
+static _Atomic(void *) *xa_create_slot(struct xarray *xa, unsigned long index)
+{
+        struct xa_node *node = atomic_load(&xa->xa_head);
+
+        if (!node) {
+                node = xa_alloc_node(0);
+                if (!node)
+                        return NULL;
+                atomic_store_explicit(&xa->xa_head, node, memory_order_release);
+        }
+        while (!xa_covers(node, index)) {
+                struct xa_node *top = xa_alloc_node(node->shift + XA_CHUNK_SHIFT);
+
+                if (!top)
+                        return NULL;
+                atomic_init(&top->slots[0], node);
+                atomic_store_explicit(&xa->xa_head, top, memory_order_release);
+                node = top;
+        }
+        while (node->shift) {
+                _Atomic(void *) *slot = &node->slots[(index >> node->shift) & XA_CHUNK_MASK];
+                struct xa_node *child = atomic_load(slot);
+
+                if (!child) {
+                        child = xa_alloc_node(node->shift - XA_CHUNK_SHIFT);
+                        if (!child)
+                                return NULL;
+                        atomic_store_explicit(slot, child, memory_order_release);
+                }
+                node = child;
+        }
+        return &node->slots[index & XA_CHUNK_MASK];
+}
+
+void *xa_store(struct xarray *xa, unsigned long index, void *entry, gfp_t gfp)
+{
+        _Atomic(void *) *slot;
+        void *old;
+
+        if (!entry)
+                return xa_erase(xa, index);
+        pthread_mutex_lock(&xa->xa_lock);
+        slot = xa_create_slot(xa, index);
+        old = slot ? atomic_exchange_explicit(slot, entry, memory_order_acq_rel) :
+                     xa_mk_err(-ENOMEM);
+        pthread_mutex_unlock(&xa->xa_lock);
+        return old;
+}
+
+void *xa_cmpxchg(struct xarray *xa, unsigned long index, void *old, void *entry,
+                 gfp_t gfp)
+{
+        _Atomic(void *) *slot;
+        void *cur;
+
+        pthread_mutex_lock(&xa->xa_lock);
+        if (entry) {
+                slot = xa_create_slot(xa, index);
+        } else {
+                struct xa_node *leaf = xa_leaf(xa, index);
+
+                slot = leaf ? &leaf->slots[index & XA_CHUNK_MASK] : NULL;
+        }
+        if (!slot) {
+                cur = entry ? xa_mk_err(-ENOMEM) : NULL;
+        } else {
+                cur = atomic_load(slot);
+                if (cur == old)
+                        atomic_store_explicit(slot, entry, memory_order_release);
+        }
+        pthread_mutex_unlock(&xa->xa_lock);
+        return cur;
+}
+
+void *xa_erase(struct xarray *xa, unsigned long index)
+{
+        struct xa_node *leaf;
+        void *old = NULL;
+
+        pthread_mutex_lock(&xa->xa_lock);
+        leaf = xa_leaf(xa, index);
+        if (leaf)
+                old = atomic_exchange(&leaf->slots[index & XA_CHUNK_MASK], NULL);
+        pthread_mutex_unlock(&xa->xa_lock);
+        return old;
+}
+
+void *xas_find(struct xa_state *xas, unsigned long max)
+{
+        unsigned long index = xas->xa_index, skip;
+
+        while (index <= max) {
+                void *entry;
+
+                if (xas->xa_range != (index >> XA_CHUNK_SHIFT) + 1) {
+                        xas->xa_node = xa_walk(xas->xa, index, &skip);
+                        if (!xas->xa_node) {
+                                xas->xa_range = 0;
+                                if (!skip)
+                                        break;
+                                index = skip;
+                                continue;
+                        }
+                        xas->xa_range = (index >> XA_CHUNK_SHIFT) + 1;
+                }
+                entry = atomic_load_explicit(&xas->xa_node->slots[index & XA_CHUNK_MASK],
+                                             memory_order_acquire);
+                if (entry) {
+                        xas->xa_index = index;
+                        return entry;
+                }
+                if (index == max || !++index)
+                        break;
+        }
+        return NULL;
+}
+
+void *xa_find(struct xarray *xa, unsigned long *index, unsigned long max)
+{
+        XA_STATE(xas, xa, *index);
+        void *entry = xas_find(&xas, max);
+
+        if (entry)
+                *index = xas.xa_index;
+        return entry;
+}
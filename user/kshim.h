@@ -0,0 +1,403 @@
+/* SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause) */
+/*
+ * Userspace stand-ins for the few kernel interfaces the sbull store core
+ * (../sbull_store.c) uses, so that it builds unchanged as an ordinary
+ * program: pages from aligned_alloc(), bvecs over them, an xarray that
+ * is a plain radix tree of 64-slot nodes with lock-free lookups and a
+ * mutex for writers, a small RCU, rw_semaphores on pthread rwlocks, and
+ * percpu counters split over per-thread slots.  Only
+ * what the core needs is here, with the kernel's semantics as far as the
+ * core can tell; nothing more.
+ */
+#ifndef _KSHIM_H
+#define _KSHIM_H
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef unsigned int gfp_t;
+typedef u64 sector_t;
+
+#define PAGE_SHIFT              12
+#define PAGE_SIZE               (1UL << PAGE_SHIFT)
+#define SECTOR_SHIFT            9
+#define BITS_PER_LONG           (sizeof(long) * CHAR_BIT)
+#define L1_CACHE_BYTES          64
+
+#define ____cacheline_aligned_in_smp __attribute__((aligned(L1_CACHE_BYTES)))
+#define likely(x)               __builtin_expect(!!(x), 1)
+#define unlikely(x)             __builtin_expect(!!(x), 0)
+#define READ_ONCE(x)            (*(const volatile __typeof__(x) *)&(x))
+#define wmb()                   atomic_thread_fence(memory_order_release)
+
+#define container_of(ptr, type, member) \
+        ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(a, b)               ((a) < (b) ? (a) : (b))
+#define max(a, b)               ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)          min((t)(a), (t)(b))
+#define round_down(x, y)        ((x) & ~((__typeof__(x))(y) - 1))
+#define offset_in_page(p)       ((unsigned long)(p) & (PAGE_SIZE - 1))
+#define upper_32_bits(n)        ((u32)((u64)(n) >> 32))
+#define lower_32_bits(n)        ((u32)(n))
+
+static inline void memset32(u32 *s, u32 v, size_t n)
+{
+        while (n--)
+                *s++ = v;
+}
+
+/* Nothing to bypass the caches with, portably: an ordinary copy. */
+static inline void memcpy_flushcache(void *dst, const void *src, size_t n)
+{
+        memcpy(dst, src, n);
+}
+
+/* Allocation flags: there is no reclaim to steer here. */
+#define GFP_KERNEL              0x0u
+#define GFP_NOIO                0x0u
+#define GFP_NOWAIT              0x0u
+#define __GFP_ZERO              0x1u
+#define __GFP_COMP              0x0u
+#define NUMA_NO_NODE            (-1)
+
+/* Bitmaps, for as many bits as fit in a few longs. */
+#define BITS_TO_LONGS(n)        (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DECLARE_BITMAP(name, bits) unsigned long name[BITS_TO_LONGS(bits)]
+
+static inline void bitmap_zero(unsigned long *map, unsigned int bits)
+{
+        memset(map, 0, BITS_TO_LONGS(bits) * sizeof(long));
+}
+
+static inline bool test_bit(unsigned int nr, const unsigned long *map)
+{
+        return map[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG) & 1;
+}
+
+static inline void __set_bit(unsigned int nr, unsigned long *map)
+{
+        map[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void set_bit(unsigned int nr, unsigned long *map)
+{
+        __atomic_fetch_or(&map[nr / BITS_PER_LONG], 1UL << (nr % BITS_PER_LONG),
+                          __ATOMIC_RELAXED);
+}
+
+/* Read-write semaphores. */
+struct rw_semaphore {
+        pthread_rwlock_t lock;
+};
+
+static inline void init_rwsem(struct rw_semaphore *sem)
+{
+        pthread_rwlock_init(&sem->lock, NULL);
+}
+
+static inline void down_read(struct rw_semaphore *sem)
+{
+        pthread_rwlock_rdlock(&sem->lock);
+}
+
+static inline void up_read(struct rw_semaphore *sem)
+{
+        pthread_rwlock_unlock(&sem->lock);
+}
+
+static inline void down_write(struct rw_semaphore *sem)
+{
+        pthread_rwlock_wrlock(&sem->lock);
+}
+
+static inline void up_write(struct rw_semaphore *sem)
+{
+        pthread_rwlock_unlock(&sem->lock);
+}
+
+/*
+ * RCU.  Each thread that reads publishes an odd counter while inside a
+ * read-side section; synchronize_rcu() waits for every thread it finds
+ * inside one to leave it.  call_rcu() batches callbacks and runs them a
+ * grace period later, from whichever caller fills the batch outside a
+ * read-side section, or from rcu_barrier().
+ */
+struct rcu_head {
+        struct rcu_head *next;
+        void (*func)(struct rcu_head *head);
+};
+
+struct kshim_rcu_reader {
+        _Atomic unsigned long ctr;      /* odd: inside a read-side section */
+        unsigned int nesting;
+        struct kshim_rcu_reader *next;
+} ____cacheline_aligned_in_smp;
+
+struct kshim_rcu_reader *kshim_rcu_register(void);
+extern __thread struct kshim_rcu_reader *kshim_rcu_self;
+
+static inline void rcu_read_lock(void)
+{
+        struct kshim_rcu_reader *r = kshim_rcu_self;
+
+        if (unlikely(!r))
+                r = kshim_rcu_register();
+        if (r->nesting++)
+                return;
+        atomic_store_explicit(&r->ctr, r->ctr + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void rcu_read_unlock(void)
+{
+        struct kshim_rcu_reader *r = kshim_rcu_self;
+
+        if (--r->nesting)
+                return;
+        atomic_store_explicit(&r->ctr, r->ctr + 1, memory_order_release);
+}
+
+void synchronize_rcu(void);
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_barrier(void);
+
+/* Pages: the struct is a header kept apart from the data it describes. */
+struct page {
+        struct rcu_head rcu_head;
+        void *addr;
+};
+
+struct page *alloc_pages_node(int node, gfp_t gfp, unsigned int order);
+void __free_pages(struct page *page, unsigned int order);
+
+static inline void __free_page(struct page *page)
+{
+        __free_pages(page, 0);
+}
+
+static inline void *page_address(struct page *page)
+{
+        return page->addr;
+}
+
+static inline unsigned int compound_order(struct page *page)
+{
+        return 0;
+}
+
+static inline void copy_page(void *to, const void *from)
+{
+        memcpy(to, from, PAGE_SIZE);
+}
+
+static inline void *kmap_local_page(struct page *page)
+{
+        return page_address(page);
+}
+
+#define kunmap_local(addr)      ((void)(addr))
+
+extern struct page kshim_zero_page;
+#define ZERO_PAGE(vaddr)        (&kshim_zero_page)
+
+/*
+ * Bvecs and their iterators.  A page here is a header apart from its
+ * data, so the single-page pieces of a bvec over a higher-order page
+ * keep its first page and carry the rest in bv_offset; page_address()
+ * plus the offset comes out the same.
+ */
+struct bio_vec {
+        struct page *bv_page;
+        unsigned int bv_len;
+        unsigned int bv_offset;
+};
+
+struct bvec_iter {
+        sector_t bi_sector;
+        unsigned int bi_size;           /* bytes left */
+        unsigned int bi_idx;            /* current bvec */
+        unsigned int bi_bvec_done;      /* bytes of it already done */
+};
+
+static inline struct bio_vec kshim_bvec_iter_bvec(const struct bio_vec *bvec,
+                                                  struct bvec_iter iter)
+{
+        const struct bio_vec *bv = &bvec[iter.bi_idx];
+        unsigned int off = bv->bv_offset + iter.bi_bvec_done;
+        unsigned int len = min(iter.bi_size, bv->bv_len - iter.bi_bvec_done);
+
+        len = min_t(unsigned int, len, PAGE_SIZE - off % PAGE_SIZE);
+        return (struct bio_vec){ .bv_page = bv->bv_page, .bv_len = len, .bv_offset = off };
+}
+
+#define bvec_iter_bvec(bvec, iter)      kshim_bvec_iter_bvec(bvec, iter)
+
+static inline void bvec_iter_advance_single(const struct bio_vec *bv,
+                                            struct bvec_iter *iter, unsigned int bytes)
+{
+        unsigned int done = iter->bi_bvec_done + bytes;
+
+        if (done == bv[iter->bi_idx].bv_len) {
+                done = 0;
+                iter->bi_idx++;
+        }
+        iter->bi_bvec_done = done;
+        iter->bi_size -= bytes;
+}
+
+/* Percpu counters, with a slot per thread (modulo KSHIM_SLOTS). */
+#define KSHIM_SLOTS             64
+
+struct percpu_counter {
+        struct {
+                _Atomic s64 count;
+        } ____cacheline_aligned_in_smp slot[KSHIM_SLOTS];
+};
+
+unsigned int kshim_slot(void);
+
+static inline int percpu_counter_init(struct percpu_counter *fbc, s64 amount, gfp_t gfp)
+{
+        memset(fbc, 0, sizeof(*fbc));
+        atomic_store(&fbc->slot[0].count, amount);
+        return 0;
+}
+
+static inline void percpu_counter_destroy(struct percpu_counter *fbc)
+{
+}
+
+static inline void percpu_counter_add(struct percpu_counter *fbc, s64 amount)
+{
+        atomic_fetch_add_explicit(&fbc->slot[kshim_slot()].count, amount,
+                                  memory_order_relaxed);
+}
+
+static inline void percpu_counter_inc(struct percpu_counter *fbc)
+{
+        percpu_counter_add(fbc, 1);
+}
+
+static inline void percpu_counter_dec(struct percpu_counter *fbc)
+{
+        percpu_counter_add(fbc, -1);
+}
+
+static inline s64 percpu_counter_sum(struct percpu_counter *fbc)
+{
+        s64 sum = 0;
+        int i;
+
+        for (i = 0; i < KSHIM_SLOTS; i++)
+                sum += atomic_load_explicit(&fbc->slot[i].count, memory_order_relaxed);
+        return sum;
+}
+
+static inline s64 percpu_counter_sum_positive(struct percpu_counter *fbc)
+{
+        s64 sum = percpu_counter_sum(fbc);
+
+        return sum < 0 ? 0 : sum;
+}
+
+/*
+ * The xarray: 64-way nodes, the tree as tall as the largest index needs.
+ * Lookups take no lock and see each slot change atomically; stores,
+ * exchanges and erases serialize on xa_lock.  Interior nodes are only
+ * freed by xa_destroy().  Entries must be pointers aligned to four bytes
+ * or value entries.
+ */
+#define XA_CHUNK_SHIFT          6
+#define XA_CHUNK_SIZE           (1UL << XA_CHUNK_SHIFT)
+#define XA_CHUNK_MASK           (XA_CHUNK_SIZE - 1)
+
+struct xa_node {
+        unsigned char shift;            /* of the index bits this node decodes */
+        _Atomic(void *) slots[XA_CHUNK_SIZE];
+};
+
+struct xarray {
+        pthread_mutex_t xa_lock;
+        _Atomic(struct xa_node *) xa_head;
+};
+
+static inline void *xa_mk_value(unsigned long v)
+{
+        return (void *)((v << 1) | 1);
+}
+
+static inline unsigned long xa_to_value(const void *entry)
+{
+        return (unsigned long)entry >> 1;
+}
+
+static inline bool xa_is_value(const void *entry)
+{
+        return (unsigned long)entry & 1;
+}
+
+static inline bool xa_is_err(const void *entry)
+{
+        return ((unsigned long)entry & 3) == 2 && (long)entry < 0;
+}
+
+static inline int xa_err(void *entry)
+{
+        return xa_is_err(entry) ? (long)entry >> 2 : 0;
+}
+
+static inline void *xa_mk_err(int err)
+{
+        return (void *)(((long)err << 2) | 2);
+}
+
+void xa_init(struct xarray *xa);
+void xa_destroy(struct xarray *xa);
+void *xa_load(struct xarray *xa, unsigned long index);
+void *xa_store(struct xarray *xa, unsigned long index, void *entry, gfp_t gfp);
+void *xa_cmpxchg(struct xarray *xa, unsigned long index, void *old, void *entry,
+                 gfp_t gfp);
+void *xa_erase(struct xarray *xa, unsigned long index);
+void *xa_find(struct xarray *xa, unsigned long *index, unsigned long max);
+
+#define xa_for_each(xa, index, entry)                                   \
+        for (index = 0, entry = xa_find(xa, &index, ULONG_MAX); entry;  \
+             entry = ++index ? xa_find(xa, &index, ULONG_MAX) : NULL)
+
+/*
+ * The xas walk, for runs of consecutive indices: it keeps hold of the
+ * leaf node it is in rather than going back to the root for each slot.
+ */
+struct xa_state {
+        struct xarray *xa;
+        unsigned long xa_index;
+        struct xa_node *xa_node;        /* leaf last walked to */
+        unsigned long xa_range;         /* its index >> XA_CHUNK_SHIFT, plus one; 0: none */
+};
+
+#define XA_STATE(name, array, index) \
+        struct xa_state name = { .xa = (array), .xa_index = (index) }
+
+void *xas_find(struct xa_state *xas, unsigned long max);
+
+static inline bool xas_retry(struct xa_state *xas, const void *entry)
+{
+        return false;
+}
+
+#define xas_for_each(xas, entry, max) \
+        for (entry = xas_find(xas, max); entry; entry = ((xas)->xa_index++, xas_find(xas, max)))
+
+#endif /* _KSHIM_H */
@@ -0,0 +1,413 @@
+// SPDX-License-Identifier: (GPL-2.0 OR BSD-2-Clause)
+/*
+ * An fio-like load generator for the sbull store core, run in userspace
+ * so that the index can be profiled without loading the driver.  I/O
+ * goes through sbull_store_{read,write}_bvec(), as sbull2's bios do:
+ *
+ *   make && ./sbull_bench -r randrw -M 70 -b 4k -j 4 -q 8 -s 2048 -t 10
+ *   perf record -g ./sbull_bench -r randwrite -j 8
+ *   valgrind --tool=helgrind ./sbull_bench -s 64 -t 2 -j 2
+ *
+ * -r   read, write, rw, randread, randwrite or randrw (default randread)
+ * -M   percentage of reads for rw and randrw (default 50)
+ * -b   block size, with an optional k or m suffix (default 4k)
+ * -s   store size in MiB (default 1024)
+ * -j   jobs (default 1)
+ * -q   I/Os in flight per job (default 1); the store is synchronous, so
+ *      each is a thread of its own, as with fio's psync engine
+ * -t   run time in seconds (default 10)
+ * -P   write the whole store before the run, so that reads find pages
+ * -z   write zeroes rather than random data, so writes become fills
+ * -d   percentage of writes that are discards instead (default 0)
+ *
+ * Prints IOPS, bandwidth and completion latency percentiles per
+ * direction, and what the store holds at the end.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sbull_store.h"
+
+enum { DIR_READ, DIR_WRITE, DIR_DISCARD, NR_DIRS };
+
+static const char * const dir_names[NR_DIRS] = { "read", "write", "discard" };
+
+/*
+ * Latencies go in log-linear buckets: exact below 64 ns, then 32 per
+ * power of two, so any percentile is within about 3% of the truth.
+ */
+#define LAT_SUB_BITS    5
+#define LAT_LINEAR      (2U << LAT_SUB_BITS)
+#define LAT_BUCKETS     (LAT_LINEAR + (64 - LAT_SUB_BITS - 1) * (1U << LAT_SUB_BITS))
+
+struct lat_stat {
+        u64 nr;
+        u64 bytes;
+        u64 sum;
+        u64 min;
+        u64 max;
+        u64 hist[LAT_BUCKETS];
+};
+
+struct worker {
+        pthread_t thread;
+        unsigned int id;
+        u64 rand;                       /* xorshift64* state */
+        unsigned long next;             /* sequential: next offset */
+        struct page *rpage;
+        struct page *wpage;             /* what every write of this worker writes */
+        struct bio_vec rvec, wvec;      /* over them, as a bio's would be */
+        int err;
+        struct lat_stat lat[NR_DIRS];
+};
+
+static struct sbull_store_shard shards[SBULL_SHARDS];
+static struct sbull_store store;
+static unsigned long size_mb = 1024;
+static unsigned long bs = 4096;
+static unsigned int jobs = 1, depth = 1, runtime = 10;
+static unsigned int mix_read = 50, mix_discard;
+static bool random_io = true, do_read = true, do_write;
+static bool prefill, zero_data;
+static atomic_bool stop;
+
+static unsigned int lat_bucket(u64 ns)
+{
+        unsigned int msb;
+
+        if (ns < LAT_LINEAR)
+                return ns;
+        msb = 63 - __builtin_clzll(ns);
+        return LAT_LINEAR + (msb - LAT_SUB_BITS - 1) * (1U << LAT_SUB_BITS) +
+               ((ns >> (msb - LAT_SUB_BITS)) & ((1U << LAT_SUB_BITS) - 1));
+}
+
+/* The middle of bucket @b, in ns. */
+static double lat_value(unsigned int b)
+{
+        unsigned int msb, sub;
+        u64 lo;
+
+        if (b < LAT_LINEAR)
+                return b;
+        b -= LAT_LINEAR;
+        msb = b / (1U << LAT_SUB_BITS) + LAT_SUB_BITS + 1;
+        sub = b % (1U << LAT_SUB_BITS);
+        lo = (1ULL << msb) + ((u64)sub << (msb - LAT_SUB_BITS));
+        return lo + (double)(1ULL << (msb - LAT_SUB_BITS)) / 2;
+}
+
+static void lat_add(struct lat_stat *l, u64 ns, unsigned long bytes)
+{
+        if (!l->nr || ns < l->min)
+                l->min = ns;
+        if (ns > l->max)
+                l->max = ns;
+        l->nr++;
+        l->bytes += bytes;
+        l->sum += ns;
+        l->hist[lat_bucket(ns)]++;
+}
+
+static void lat_merge(struct lat_stat *to, const struct lat_stat *from)
+{
+        unsigned int b;
+
+        if (!from->nr)
+                return;
+        if (!to->nr || from->min < to->min)
+                to->min = from->min;
+        if (from->max > to->max)
+                to->max = from->max;
+        to->nr += from->nr;
+        to->bytes += from->bytes;
+        to->sum += from->sum;
+        for (b = 0; b < LAT_BUCKETS; b++)
+                to->hist[b] += from->hist[b];
+}
+
+static double lat_percentile(const struct lat_stat *l, double pct)
+{
+        u64 want = (u64)(l->nr * pct / 100.0), seen = 0;
+        unsigned int b;
+
+        for (b = 0; b < LAT_BUCKETS; b++) {
+                seen += l->hist[b];
+                if (seen > want)
+                        return lat_value(b);
+        }
+        return l->max;
+}
+
+static inline u64 now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline u64 next_rand(struct worker *w)
+{
+        w->rand ^= w->rand >> 12;
+        w->rand ^= w->rand << 25;
+        w->rand ^= w->rand >> 27;
+        return w->rand * 0x2545f4914f6cdd1dULL;
+}
+
+static void fill_random(struct worker *w, char *buf, unsigned long len)
+{
+        unsigned long i;
+
+        for (i = 0; i + sizeof(u64) <= len; i += sizeof(u64)) {
+                u64 r = next_rand(w);
+
+                memcpy(buf + i, &r, sizeof(r));
+        }
+}
+
+/* A bio's iterator for one block at @off. */
+static inline struct bvec_iter block_iter(unsigned long off)
+{
+        return (struct bvec_iter){ .bi_sector = off >> SECTOR_SHIFT, .bi_size = bs };
+}
+
+static unsigned long next_offset(struct worker *w)
+{
+        unsigned long blocks = store.size / bs, off;
+
+        if (random_io)
+                return next_rand(w) % blocks * bs;
+        off = w->next;
+        w->next = off + bs >= blocks * bs ? 0 : off + bs;
+        return off;
+}
+
+static int pick_dir(struct worker *w)
+{
+        if (!do_write)
+                return DIR_READ;
+        if (do_read && next_rand(w) % 100 < mix_read)
+                return DIR_READ;
+        if (mix_discard && next_rand(w) % 100 < mix_discard)
+                return DIR_DISCARD;
+        return DIR_WRITE;
+}
+
+static void *worker_fn(void *arg)
+{
+        struct worker *w = arg;
+
+        while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+                unsigned long off = next_offset(w);
+                int dir = pick_dir(w);
+                u64 start = now_ns();
+                int ret;
+
+                switch (dir) {
+                case DIR_READ:
+                        ret = sbull_store_read_bvec(&store, &w->rvec, block_iter(off), false);
+                        break;
+                case DIR_WRITE:
+                        ret = sbull_store_write_bvec(&store, &w->wvec, block_iter(off), false);
+                        break;
+                default:
+                        ret = sbull_store_discard(&store, off, bs);
+                        break;
+                }
+                if (ret) {
+                        w->err = ret;
+                        break;
+                }
+                lat_add(&w->lat[dir], now_ns() - start, bs);
+        }
+        return NULL;
+}
+
+/* The same data the workers write, across the whole store. */
+static int prefill_store(struct worker *w)
+{
+        unsigned long off;
+        int ret;
+
+        for (off = 0; off + bs <= store.size; off += bs) {
+                ret = sbull_store_write_bvec(&store, &w->wvec, block_iter(off), false);
+                if (ret)
+                        return ret;
+        }
+        return 0;
+}
+
+static unsigned long parse_size(const char *s)
+{
+        char *end;
+        unsigned long v = strtoul(s, &end, 0);
+
+        switch (*end) {
+        case 'k': case 'K':
+                return v << 10;
+        case 'm': case 'M':
+                return v << 20;
+        default:
+                return *end ? 0 : v;
+        }
+}
+
+static int parse_rw(const char *s)
+{
+        static const struct {
+                const char *name;
+                bool random, read, write;
+        } modes[] = {
+                { "read", false, true, false },
+                { "write", false, false, true },
+                { "rw", false, true, true },
+                { "randread", true, true, false },
+                { "randwrite", true, false, true },
+                { "randrw", true, true, true },
+        };
+        unsigned int i;
+
+        for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+                if (!strcmp(s, modes[i].name)) {
+                        random_io = modes[i].random;
+                        do_read = modes[i].read;
+                        do_write = modes[i].write;
+                        if (!do_read)
+                                mix_read = 0;
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [-r read|write|rw|randread|randwrite|randrw] [-M rwmixread]\n"
+                "       [-b bs] [-s size_mb] [-j jobs] [-q depth] [-t secs] [-P] [-z]\n"
+                "       [-d discard_pct]\n", prog);
+        exit(2);
+}
+
+static void report(const struct lat_stat *l, const char *name, double secs)
+{
+        static const double pcts[] = { 50, 90, 99, 99.9, 99.99 };
+        unsigned int i;
+
+        if (!l->nr)
+                return;
+        printf("  %-7s: IOPS=%.0f, BW=%.1fMiB/s, lat (ns): min=%llu avg=%.0f max=%llu\n",
+               name, l->nr / secs, l->bytes / secs / (1 << 20),
+               (unsigned long long)l->min, (double)l->sum / l->nr,
+               (unsigned long long)l->max);
+        printf("           percentiles (ns):");
+        for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+                printf(" p%g=%.0f", pcts[i], lat_percentile(l, pcts[i]));
+        printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+        const char *rw = "randread";
+        struct lat_stat total[NR_DIRS] = {};
+        unsigned int i, d, nr, order = 0;
+        struct worker *workers;
+        u64 start, end;
+        double secs;
+        int opt, err = 0;
+
+        while ((opt = getopt(argc, argv, "r:M:b:s:j:q:t:Pzd:h")) != -1) {
+                switch (opt) {
+                case 'r': rw = optarg; break;
+                case 'M': mix_read = atoi(optarg); break;
+                case 'b': bs = parse_size(optarg); break;
+                case 's': size_mb = strtoul(optarg, NULL, 0); break;
+                case 'j': jobs = atoi(optarg); break;
+                case 'q': depth = atoi(optarg); break;
+                case 't': runtime = atoi(optarg); break;
+                case 'P': prefill = true; break;
+                case 'z': zero_data = true; break;
+                case 'd': mix_discard = atoi(optarg); break;
+                default: usage(argv[0]);
+                }
+        }
+        if (parse_rw(rw) || !bs || bs % 512 || !size_mb || bs > size_mb << 20 ||
+            !jobs || !depth || mix_read > 100 || mix_discard > 100)
+                usage(argv[0]);
+
+        sbull_store_init_shards(shards);
+        if (sbull_store_init(&store, shards, size_mb << 20, NUMA_NO_NODE)) {
+                fprintf(stderr, "can't set up the store\n");
+                return 1;
+        }
+
+        while (PAGE_SIZE << order < bs)
+                order++;
+        nr = jobs * depth;
+        workers = calloc(nr, sizeof(*workers));
+        if (!workers)
+                return 1;
+        for (i = 0; i < nr; i++) {
+                struct worker *w = &workers[i];
+
+                w->id = i;
+                w->rand = 0x9e3779b97f4a7c15ULL * (i + 1);
+                w->next = (store.size / bs) / nr * i * bs;
+                w->rpage = alloc_pages_node(NUMA_NO_NODE, 0, order);
+                w->wpage = alloc_pages_node(NUMA_NO_NODE, __GFP_ZERO, order);
+                if (!w->rpage || !w->wpage)
+                        return 1;
+                w->rvec = (struct bio_vec){ .bv_page = w->rpage, .bv_len = bs };
+                w->wvec = (struct bio_vec){ .bv_page = w->wpage, .bv_len = bs };
+                if (!zero_data)
+                        fill_random(w, page_address(w->wpage), bs);
+        }
+        if (prefill && (err = prefill_store(&workers[0]))) {
+                fprintf(stderr, "prefill failed: %s\n", strerror(-err));
+                return 1;
+        }
+
+        start = now_ns();
+        for (i = 0; i < nr; i++) {
+                if (pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i])) {
+                        fprintf(stderr, "can't start worker %u\n", i);
+                        atomic_store(&stop, true);
+                        nr = i;
+                        break;
+                }
+        }
+        sleep(runtime);
+        atomic_store(&stop, true);
+        for (i = 0; i < nr; i++) {
+                pthread_join(workers[i].thread, NULL);
+                for (d = 0; d < NR_DIRS; d++)
+                        lat_merge(&total[d], &workers[i].lat[d]);
+                if (workers[i].err)
+                        err = workers[i].err;
+        }
+        end = now_ns();
+        secs = (end - start) / 1e9;
+
+        printf("%s: bs=%lu size=%luMiB jobs=%u depth=%u runtime=%.1fs%s%s\n",
+               rw, bs, size_mb, jobs, depth, secs, prefill ? " prefilled" : "",
+               zero_data ? " zero-data" : "");
+        for (d = 0; d < NR_DIRS; d++)
+                report(&total[d], dir_names[d], secs);
+        printf("  store  : pages=%lld same=%lld\n",
+               (long long)percpu_counter_sum(&store.nr_pages),
+               (long long)percpu_counter_sum(&store.nr_same));
+        if (err)
+                fprintf(stderr, "I/O error: %s\n", strerror(-err));
+
+        for (i = 0; i < jobs * depth; i++) {
+                __free_pages(workers[i].rpage, order);
+                __free_pages(workers[i].wpage, order);
+        }
+        free(workers);
+        sbull_store_clear(&store);
+        sbull_store_destroy(&store);
+        return err ? 1 : 0;
+}